@@ -0,0 +1,198 @@
+/**
+    @brief ADC service for VBAT, VREF and BTN channels
+    @author avegawanderer
+*/
+
+#include "global_def.h"
+#include "adc.h"
+
+
+/*
+    Channels are scanned by single conversions started from EOC interrupt, so CPU stays in WFI
+    while ADC is busy (ADC requires HSI and does not run in active-halt).
+    First conversion after channel switch is discarded to let sampling capacitor settle,
+    then 2^ADC_OVERSAMPLE_LOG2 samples are summed in place.
+    ADC is woken from power-down and gets tSTAB before the first conversion. External reference
+    is supplied at scan start and is converted last, so it settles while VBAT and BTN are converted
+    (about 240us).
+
+    Voltages are converted using external reference at VREF pin, so result does not depend on VDD.
+    Results are published by ISR at the end of scan together with incremented update counter.
+    Scan takes about 51 conversions * 7us at Fadc = 2MHz.
+*/
+
+#define ADC_OVERSAMPLE          (1 << ADC_OVERSAMPLE_LOG2)
+
+// Sum of oversampled conversions for input equal to VDD
+#define ADC_FULL_SCALE_SUM      (1024UL * ADC_OVERSAMPLE)
+
+// ADC wake-up time from power-down (tSTAB is 7us max), loop iterations of a few cycles at Fmaster = 4MHz
+#define ADC_STAB_LOOPS          10
+
+// Scanned channels, VREF goes last since VREF_SUPP is enabled at scan start
+typedef enum {
+    adcScanVbat,
+    adcScanBtn,
+    adcScanVref,
+    adcScanCount
+} eAdcScan;
+
+static const uint8_t adcScanChannel[adcScanCount] = {
+    adcChVbat,
+    adcChBtn,
+    adcChVref
+};
+
+
+static struct {
+    uint16_t sum[adcScanCount];
+    uint8_t scanIndex;
+    uint8_t sampleCount;            // 0 for discarded conversion
+    volatile uint8_t isBusy;
+    volatile uint8_t updateCount;   // Incremented when new results are published
+    adcResult_t result;
+} adcData;
+
+
+
+/**
+    Init ADC
+
+    ADC is kept powered down between scans
+*/
+void Adc_Init(void)
+{
+    ADC1_DeInit();
+
+    // Fadc = Fmaster / 2, right alignment
+    ADC1->CR1 = ADC1_PRESSEL_FCPU_D2;
+    ADC1->CR2 = ADC1_ALIGN_RIGHT;
+
+    // Disable digital input buffers of analog pins
+    ADC1_SchmittTriggerConfig(ADC1_SCHMITTTRIG_CHANNEL3, DISABLE);
+    ADC1_SchmittTriggerConfig(ADC1_SCHMITTTRIG_CHANNEL4, DISABLE);
+}
+
+
+/**
+    Start scan of all channels
+
+    Does nothing if scan is in progress
+*/
+void Adc_StartScan(void)
+{
+    uint8_t i;
+
+    if (adcData.isBusy)
+        return;
+    adcData.isBusy = 1;
+    adcData.scanIndex = 0;
+    adcData.sampleCount = 0;
+    adcData.sum[0] = 0;
+
+    // Supply for external reference
+    GPIO_WriteHigh(GPIOD, GPD_VREF_SUPP_PIN);
+
+    // Wake up ADC from power-down, second ADON write after tSTAB starts conversion
+    ADC1->CSR = (uint8_t)(ADC1_CSR_EOCIE | adcScanChannel[0]);
+    ADC1->CR1 |= ADC1_CR1_ADON;
+    for (i = 0; i < ADC_STAB_LOOPS; i++)
+    {
+        asm("NOP");
+    }
+    ADC1->CR1 |= ADC1_CR1_ADON;
+}
+
+
+uint8_t Adc_IsBusy(void)
+{
+    return adcData.isBusy;
+}
+
+
+/**
+    Wait until scan is done
+
+    CPU is in WFI meanwhile
+*/
+void Adc_WaitScanDone(void)
+{
+    // Checked with interrupts disabled: EOC interrupt between the check and WFI would leave
+    // CPU asleep until AWU. WFI enables interrupts and wakes at once then.
+    disableInterrupts();
+    while (adcData.isBusy)
+    {
+        asm("WFI");
+        disableInterrupts();
+    }
+    enableInterrupts();
+}
+
+
+/**
+    Get results of the last scan
+
+    @param result Copy of results
+    @return Update counter, 0 if no scan is done yet
+*/
+uint8_t Adc_GetResult(adcResult_t *result)
+{
+    uint8_t updateCount;
+    // Results are not read atomically, repeat if they have been updated by ISR
+    do {
+        updateCount = adcData.updateCount;
+        *result = adcData.result;
+    } while (updateCount != adcData.updateCount);
+    return updateCount;
+}
+
+
+// Convert sums of oversampled conversions and publish results
+static void publishResults(void)
+{
+    uint16_t vref = adcData.sum[adcScanVref];
+
+    if (vref != 0)
+    {
+        adcData.result.vddMv = (uint16_t)((ADC_FULL_SCALE_SUM * ADC_VREF_MV) / vref);
+        adcData.result.vbatMv = (uint16_t)(((uint32_t)adcData.sum[adcScanVbat] * ADC_VREF_MV * ADC_VBAT_DIVIDER) / vref);
+    }
+    adcData.result.btnLevel = adcData.sum[adcScanBtn] >> (ADC_OVERSAMPLE_LOG2 - 2);
+
+    // Skip 0, it means no results
+    if (++adcData.updateCount == 0)
+        adcData.updateCount = 1;
+}
+
+
+INTERRUPT_HANDLER(IRQ_Handler_ADC1, 22)
+{
+    uint16_t value;
+
+    // Right alignment: LSB must be read first
+    value = ADC1->DRL;
+    value |= (uint16_t)ADC1->DRH << 8;
+
+    if (adcData.sampleCount != 0)
+        adcData.sum[adcData.scanIndex] += value;
+
+    if (++adcData.sampleCount > ADC_OVERSAMPLE)
+    {
+        adcData.sampleCount = 0;
+        if (++adcData.scanIndex >= adcScanCount)
+        {
+            // Scan is done, power down ADC and reference
+            ADC1->CSR = 0;
+            ADC1->CR1 &= (uint8_t)(~ADC1_CR1_ADON);
+            GPIO_WriteLow(GPIOD, GPD_VREF_SUPP_PIN);
+            publishResults();
+            adcData.isBusy = 0;
+            return;
+        }
+        adcData.sum[adcData.scanIndex] = 0;
+    }
+
+    // Clears EOC flag, next conversion
+    ADC1->CSR = (uint8_t)(ADC1_CSR_EOCIE | adcScanChannel[adcData.scanIndex]);
+    ADC1->CR1 |= ADC1_CR1_ADON;
+}
@@ -0,0 +1,34 @@
+#ifndef __ADC_H__
+#define __ADC_H__
+
+#include "global_def.h"
+
+
+// Voltage of external reference at VREF pin [mV]
+#define ADC_VREF_MV             2500
+
+// VBAT divider ratio (R1 + R2) / R2
+#define ADC_VBAT_DIVIDER        2
+
+// Number of samples averaged for each channel is 2^ADC_OVERSAMPLE_LOG2
+// 16 samples give 2 extra bits of resolution
+#define ADC_OVERSAMPLE_LOG2     4
+
+
+// Scan results
+typedef struct {
+    uint16_t vddMv;             // MCU supply voltage
+    uint16_t vbatMv;            // Battery voltage
+    uint16_t btnLevel;          // BTN pin level, 12-bit relative to VDD
+} adcResult_t;
+
+
+void Adc_Init(void);
+void Adc_StartScan(void);
+uint8_t Adc_IsBusy(void);
+void Adc_WaitScanDone(void);
+uint8_t Adc_GetResult(adcResult_t *result);
+
+
+
+#endif  // __ADC_H__
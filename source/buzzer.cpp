@@ -14,7 +14,7 @@
 // Data
 
 
-static eBuzState buzzerState = BZ_IDLE;
+static volatile eBuzState buzzerState = BZ_IDLE;
 static buzzerData_t buzzerData;
 
 
@@ -25,6 +25,154 @@ static buzzerData_t buzzerData;
 void onBuzzerStateChanged(uint8_t isActive);
 
 
+//=================================================================//
+// Queue helpers
+
+
+static uint8_t isQueueEmpty(void)
+{
+    return (buzzerData.queue.wrIndex == buzzerData.queue.rdIndex);
+}
+
+
+// Must be called for non-empty queue only
+static buzQueueElement_t popQueue(void)
+{
+    buzQueue_t *q = &buzzerData.queue;
+    uint8_t rdIndex = q->rdIndex;
+    buzQueueElement_t elm = q->buf[rdIndex & BUZZER_QUEUE_MASK];
+    // Release element after it has been read
+    q->rdIndex = rdIndex + 1;
+    return elm;
+}
+
+
+//=================================================================//
+// Pattern interpreter
+
+
+static void resetPattern(void)
+{
+    buzzerData.pattern.pc = 0;
+    buzzerData.pattern.volumeLimit = VolumeHigh;
+}
+
+
+/**
+    Run pattern instructions until next note is found
+
+    @return 1 if note is fetched to elm, 0 if pattern has ended
+*/
+static uint8_t fetchPatternNote(buzQueueElement_t *elm)
+{
+    buzPattern_t *p = &buzzerData.pattern;
+    uint8_t op;
+    while (p->pc)
+    {
+        op = *p->pc++;
+        switch (op & BZP_OP_MASK)
+        {
+            case BZP_OP_NOTE:
+                elm->tone = op & BZP_ARG_MASK;
+                elm->duration = *p->pc++;
+                return 1;
+
+            case BZP_OP_LOOP:
+                p->loopCount = *p->pc++;
+                p->loopStart = p->pc;
+                break;
+
+            case BZP_OP_ENDLOOP:
+                if (p->loopCount > 1)
+                {
+                    p->loopCount--;
+                    p->pc = p->loopStart;
+                }
+                break;
+
+            case BZP_OP_VOLUME:
+                p->volumeLimit = (eVolume)(op & BZP_ARG_MASK);
+                break;
+
+            default:
+                // BZP_END or invalid instruction
+                resetPattern();
+                break;
+        }
+    }
+    return 0;
+}
+
+
+// Get next tone to play: pattern has priority over queue
+static uint8_t fetchNextTone(buzQueueElement_t *elm)
+{
+    if (fetchPatternNote(elm))
+        return 1;
+    if (isQueueEmpty())
+        return 0;
+    *elm = popQueue();
+    return 1;
+}
+
+
+static uint8_t hasNextTone(void)
+{
+    return (buzzerData.pattern.pc != 0) || !isQueueEmpty();
+}
+
+
+static eVolume getEffectiveVolume(void)
+{
+    return (buzzerData.volume < buzzerData.pattern.volumeLimit) ? buzzerData.volume : buzzerData.pattern.volumeLimit;
+}
+
+
+// Count duration and charge of the tone that has been played
+static void countPlayedTone(void)
+{
+    buzzerData.playTimeMs += buzzerData.toneDurationMs;
+    buzzerData.chargeMaMs += (uint32_t)buzzerData.toneDurationMs * buzzerData.toneCurrentMa;
+}
+
+
+/**
+    Start next tone from pattern or queue. If there is nothing to play, stop.
+
+    Called either from tone ISR or from main loop while tone ISR is not active
+*/
+static void startNextTone(void)
+{
+    buzQueueElement_t elm;
+    eVolume volume;
+    if (fetchNextTone(&elm))
+    {
+        volume = getEffectiveVolume();
+        buzzerData.toneDurationMs = (uint16_t)elm.duration * BUZZER_DURATION_UNIT_MS;
+        buzzerData.toneCurrentMa = PWM_GetCurrentMa((eTone)elm.tone, volume);
+        if (PWM_IsLowPowerVolume(volume))
+        {
+            // BEEP keeps running in active-halt, tone is timed by FSM
+            buzzerData.lowPowerTicks = elm.duration * (BUZZER_DURATION_UNIT_MS / BUZZER_FSM_CALL_PERIOD_MS);
+            buzzerState = BZ_PLAYING_LOW_POWER_TONE;
+            PWM_BeepLowPower((eTone)elm.tone, volume);
+        }
+        else
+        {
+            buzzerState = BZ_PLAYING_QUEUED_TONE;
+            PWM_BeepTimed((eTone)elm.tone, volume, buzzerData.toneDurationMs);
+        }
+        onBuzzerStateChanged(elm.tone != ToneSilence);
+    }
+    else
+    {
+        PWM_Stop();
+        buzzerState = BZ_IDLE;
+        onBuzzerStateChanged(0);
+    }
+}
+
+
 //=================================================================//
 // Control interface
 
@@ -33,7 +181,9 @@ void Buzz_Init(eVolume volume)
 {
     buzzerState = BZ_IDLE;
     buzzerData.volume = volume;
-    buzzerData.queueWrCount = 0;
+    buzzerData.queue.rdIndex = buzzerData.queue.wrIndex;
+    buzzerData.queue.overflowCount = 0;
+    resetPattern();
 }
 
 
@@ -49,24 +199,57 @@ void Buzz_BeepContinuous(eTone tone)
     PWM_Beep(tone, buzzerData.volume);
     buzzerState = BZ_CONTINUOUS;
     // Clear queue
-    buzzerData.queueWrCount = 0;
+    buzzerData.queue.rdIndex = buzzerData.queue.wrIndex;
+    resetPattern();
     onBuzzerStateChanged(1);
 }
 
 
+/**
+    Put tone into the queue
+
+    Queue is lock-free single-producer / single-consumer ring buffer, so this function
+    may be called from ISR (UART, capture), but only from one context at a time.
+    Continuous beep is replaced with queued tones by FSM.
+    Duration is rounded up to BUZZER_DURATION_UNIT_MS and limited to BUZZER_MAX_DURATION units.
+*/
 void Buzz_PutTone(eTone tone, uint16_t ms)
 {
-    // Tone queue processing requires FSM to be called
-    if (buzzerState == BZ_CONTINUOUS)
+    buzQueue_t *q = &buzzerData.queue;
+    uint8_t wrIndex = q->wrIndex;
+    uint16_t duration;
+
+    if ((uint8_t)(wrIndex - q->rdIndex) >= BUZZER_QUEUE_SIZE)
     {
-        PWM_Stop();
-        buzzerState = BZ_IDLE;
-        onBuzzerStateChanged(0);
+        // Queue is full
+        if (q->overflowCount < 0xFF)
+            q->overflowCount++;
+        return;
     }
 
-    // Queued beeps will be processed by FSM
-    if (buzzerData.queueWrCount < BUZZER_QUEUE_SIZE)
-        buzzerData.queue[buzzerData.queueWrCount++] = (buzQueueElement_t){tone, ms};
+    duration = (ms + BUZZER_DURATION_UNIT_MS - 1) / BUZZER_DURATION_UNIT_MS;
+    if (duration > BUZZER_MAX_DURATION)
+        duration = BUZZER_MAX_DURATION;
+
+    q->buf[wrIndex & BUZZER_QUEUE_MASK] = (buzQueueElement_t){(uint8_t)tone, (uint8_t)duration};
+    // Publish element after it has been written
+    q->wrIndex = wrIndex + 1;
+}
+
+
+/**
+    Start playing pattern from FLASH
+
+    Pattern currently being played is replaced, queued tones are played after the pattern.
+    Must be called from the same context as Buzz_Process()
+*/
+void Buzz_PlayPattern(const uint8_t *pattern)
+{
+    // Tone IRQ must be stopped before pattern state is modified
+    PWM_Stop();
+    resetPattern();
+    buzzerData.pattern.pc = pattern;
+    startNextTone();
 }
 
 
@@ -75,14 +258,15 @@ void Buzz_Stop(void)
     PWM_Stop();
     buzzerState = BZ_IDLE;
     // Clear queue
-    buzzerData.queueWrCount = 0;
+    buzzerData.queue.rdIndex = buzzerData.queue.wrIndex;
+    resetPattern();
     onBuzzerStateChanged(0);
 }
 
 
 uint8_t Buzz_IsActive(void)
 {
-    return (buzzerState != BZ_IDLE) || (buzzerData.queueWrCount > 0);
+    return (buzzerState != BZ_IDLE) || hasNextTone();
 }
 
 
@@ -92,71 +276,100 @@ uint8_t Buzz_IsContinuousBeep(void)
 }
 
 
-//=================================================================//
-// FSM
+/**
+    Check if CPU may enter active-halt
+
+    @return 0 if buzzer requires TIM1 to be clocked
+*/
+uint8_t Buzz_IsHaltAllowed(void)
+{
+    return (buzzerState == BZ_IDLE) || (buzzerState == BZ_PLAYING_LOW_POWER_TONE);
+}
 
 
-void Buzz_Process(void)
+uint8_t Buzz_GetOverflowCount(void)
 {
-    buzQueueElement_t elm;
-    uint8_t exit = 0;
-    while (!exit)
-    {
-        // Run once by default
-        exit = 1;
-        switch (buzzerState)
-        {
-            case BZ_IDLE:
-                if (buzzerData.queueWrCount > 0)
-                {
-                    buzzerState = BZ_START_QUEUED_TONE;
-                    onBuzzerStateChanged(1);
-                    exit = 0;
-                }
-                break;
+    return buzzerData.queue.overflowCount;
+}
 
-            case BZ_START_QUEUED_TONE:
-                elm = buzzerData.queue[0];
-                // Shift queue
-                for (uint8_t i=0; i<buzzerData.queueWrCount; i++)
-                {
-                    // Nothing to shift in for full queue
-                    if (i == BUZZER_QUEUE_SIZE-1)
-                        continue;
-                    buzzerData.queue[i] = buzzerData.queue[i+1];
-                }
-                buzzerData.queueWrCount--;
-                PWM_Beep(elm.tone, buzzerData.volume);
-                onBuzzerStateChanged(elm.tone != ToneSilence);
-                buzzerData.timer = 0;
-                buzzerData.toneDurationMs = elm.ms;
-                buzzerState = BZ_PLAYING_QUEUED_TONE;
-                break;
 
-            case BZ_PLAYING_QUEUED_TONE:
-                buzzerData.timer += BUZZER_FSM_CALL_PERIOD_MS;
-                if (buzzerData.timer >= buzzerData.toneDurationMs)
-                {
-                    if (buzzerData.queueWrCount > 0)
-                    {
-                        buzzerState = BZ_START_QUEUED_TONE;
-                        exit = 0;
-                    }
-                    else
-                    {
-                        PWM_Stop();
-                        buzzerState = BZ_IDLE;
-                        onBuzzerStateChanged(0);
-                    }
-                }
-                break;
+/**
+    Get number of queued tones
 
-            default:
-                break;
-        }
-    }
+    @return Tones waiting in the queue, up to BUZZER_QUEUE_SIZE
+*/
+uint8_t Buzz_GetQueueCount(void)
+{
+    return (uint8_t)(buzzerData.queue.wrIndex - buzzerData.queue.rdIndex);
+}
+
+
+uint8_t Buzz_GetQueueFree(void)
+{
+    return BUZZER_QUEUE_SIZE - Buzz_GetQueueCount();
+}
+
+
+/**
+    Get total time of played tones
+
+    @return Free-running counter of played tones duration [ms], updated at the end of each tone
+*/
+uint16_t Buzz_GetPlayTimeMs(void)
+{
+    return buzzerData.playTimeMs;
+}
+
+
+/**
+    Get charge consumed by played tones
+
+    Continuous beep is not counted, it is used while main supply is present.
+    @return Free-running counter [mA*ms], updated at the end of each tone
+*/
+uint32_t Buzz_GetChargeMaMs(void)
+{
+    uint32_t charge;
+    // 32-bit value is not read atomically, repeat if it has been updated by ISR
+    do {
+        charge = buzzerData.chargeMaMs;
+    } while (charge != buzzerData.chargeMaMs);
+    return charge;
 }
 
 
+//=================================================================//
+// FSM
+// Tone sequencing is driven by TIM1 update interrupt, see PWM_BeepTimed()
+// Buzz_Process() starts tones that have been queued while buzzer was idle
+// and counts low-power tones
+
 
+// Callback from PWM module, called from ISR
+void onPwmNoteDone(void)
+{
+    countPlayedTone();
+    startNextTone();
+}
 
+
+void Buzz_Process(void)
+{
+    if (buzzerState == BZ_PLAYING_LOW_POWER_TONE)
+    {
+        if (buzzerData.lowPowerTicks > 1)
+        {
+            buzzerData.lowPowerTicks--;
+        }
+        else
+        {
+            countPlayedTone();
+            startNextTone();
+        }
+    }
+    // Tone IRQ is not active unless a tone is playing
+    else if ((buzzerState != BZ_PLAYING_QUEUED_TONE) && hasNextTone())
+    {
+        startNextTone();
+    }
+}
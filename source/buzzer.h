@@ -3,16 +3,53 @@
 
 #include "global_def.h"
 
+// Buzz_Process() call period
+// Queued tones are timed by TIM1, but low-power tones (see PWM_IsLowPowerVolume()) are timed by FSM
 #define BUZZER_FSM_CALL_PERIOD_MS          10
 
+/*
+    Tone pattern bytecode
+    Patterns are const byte arrays stored in FLASH and played directly from there.
+    Durations are in units of 10ms (1 to 255)
+
+    BZP_NOTE(tone, dur)     Play tone                                   [0x1t, dur]
+    BZP_REST(dur)           Silence                                     [0x10, dur]
+    BZP_LOOP(n)             Repeat block until BZP_ENDLOOP n times      [0x20, n]
+    BZP_ENDLOOP             End of repeated block, no nesting           [0x30]
+    BZP_VOLUME(v)           Limit volume for the rest of the pattern    [0x4v]
+                            (user volume setting is never exceeded)
+    BZP_END                 End of pattern                              [0x00]
+*/
+#define BZP_OP_END          0x00
+#define BZP_OP_NOTE         0x10
+#define BZP_OP_LOOP         0x20
+#define BZP_OP_ENDLOOP      0x30
+#define BZP_OP_VOLUME       0x40
+#define BZP_OP_MASK         0xF0
+#define BZP_ARG_MASK        0x0F
+
+#define BZP_NOTE(tone, dur) (BZP_OP_NOTE | (tone)), (dur)
+#define BZP_REST(dur)       BZP_NOTE(ToneSilence, dur)
+#define BZP_LOOP(n)         BZP_OP_LOOP, (n)
+#define BZP_ENDLOOP         BZP_OP_ENDLOOP
+#define BZP_VOLUME(v)       (BZP_OP_VOLUME | (v))
+#define BZP_END             BZP_OP_END
+
 
 void Buzz_Init(eVolume volume);
 void Buzz_SetVolume(eVolume volume);
 void Buzz_BeepContinuous(eTone tone);
 void Buzz_PutTone(eTone tone, uint16_t ms);
+void Buzz_PlayPattern(const uint8_t *pattern);
 void Buzz_Stop(void);
 uint8_t Buzz_IsActive(void);
 uint8_t Buzz_IsContinuousBeep(void);
+uint8_t Buzz_IsHaltAllowed(void);
+uint8_t Buzz_GetOverflowCount(void);
+uint8_t Buzz_GetQueueCount(void);
+uint8_t Buzz_GetQueueFree(void);
+uint16_t Buzz_GetPlayTimeMs(void);
+uint32_t Buzz_GetChargeMaMs(void);
 void Buzz_Process(void);
 
 
@@ -3,34 +3,63 @@
 
 #include "global_def.h"
 
-// Tone queue size
-#define BUZZER_QUEUE_SIZE       20
+// Tone queue size, must be power of 2
+#define BUZZER_QUEUE_SIZE       16
+#define BUZZER_QUEUE_MASK       (BUZZER_QUEUE_SIZE - 1)
 
+// Tone duration is stored in units of this period [ms]
+#define BUZZER_DURATION_UNIT_MS 10
+#define BUZZER_MAX_DURATION     0xFF
 
 
-// Queue element
+
+// Queue element, packed to 2 bytes
 typedef struct {
-    eTone tone;
-    uint16_t ms;
+    uint8_t tone;           // eTone
+    uint8_t duration;       // [BUZZER_DURATION_UNIT_MS]
 } buzQueueElement_t;
 
 
 // Buzzer FSM states
 typedef enum {
     BZ_IDLE,
-    BZ_START_QUEUED_TONE,
-    BZ_PLAYING_QUEUED_TONE,
+    BZ_PLAYING_QUEUED_TONE,         // Tone from TIM1, timed by TIM1
+    BZ_PLAYING_LOW_POWER_TONE,      // Tone from BEEP, timed by Buzz_Process() calls
     BZ_CONTINUOUS
 } eBuzState;
 
 
+// Single-producer / single-consumer ring buffer
+// Write index is modified by producer only (main loop or ISR, Buzz_PutTone()),
+// read index is modified by consumer only (buzzer FSM).
+// Indexes are free-running, number of elements is (wrIndex - rdIndex)
+typedef struct {
+    buzQueueElement_t buf[BUZZER_QUEUE_SIZE];
+    volatile uint8_t wrIndex;
+    volatile uint8_t rdIndex;
+    volatile uint8_t overflowCount;     // Number of tones dropped due to full queue, saturated
+} buzQueue_t;
+
+
+// Pattern interpreter state
+typedef struct {
+    const uint8_t *pc;              // Next instruction, 0 if no pattern is being played
+    const uint8_t *loopStart;       // First instruction of repeated block
+    uint8_t loopCount;              // Remaining repetitions
+    eVolume volumeLimit;
+} buzPattern_t;
+
+
 // Buzzer data
 typedef struct {
-    uint16_t timer;
     uint16_t toneDurationMs;
+    uint8_t toneCurrentMa;          // Estimated supply current for the tone being played
+    uint8_t lowPowerTicks;          // Remaining Buzz_Process() calls for low-power tone
+    volatile uint16_t playTimeMs;
+    volatile uint32_t chargeMaMs;   // Charge consumed by played tones [mA*ms]
     eVolume volume;
-    buzQueueElement_t queue[BUZZER_QUEUE_SIZE];
-    uint8_t queueWrCount;
+    buzQueue_t queue;
+    buzPattern_t pattern;
 
 
 } buzzerData_t;
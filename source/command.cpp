@@ -0,0 +1,349 @@
+/**
+    @brief Framed command protocol for control by flight controller
+    @author avegawanderer
+*/
+
+#include "global_def.h"
+#include "command.h"
+#include "uart.h"
+#include "buzzer.h"
+#include "nvm.h"
+
+
+/*
+    Frame:  [CMD_SYNC] [length] [command] [payload] [CRC8]
+        length  - number of command and payload bytes
+        CRC8    - DVB-S2 over length, command and payload
+    Frames are taken from complete UART messages, a message may contain several frames.
+    Each valid frame is answered immediately by frame with command | CMD_REPLY and payload
+    starting with result code. Frames with bad CRC are dropped, sender should retry on timeout.
+    Device may be in active-halt, so a wake preamble byte must precede frames, see uart.cpp.
+    Multi-byte values are little-endian, except for telemetry snapshot.
+
+    Commands and payload:
+        CmdPlayPattern      [bytecode ...]          Play pattern, see buzzer.h, BZP_END is optional
+        CmdPlayTones        [tone, duration] * n    Queue tones, duration in 10ms units.
+                                                    Either all tones are queued or none (CmdBusy)
+        CmdSetVolume        [volume]
+        CmdTimeoutAlarm     [armed]                 Arm (1) or disarm (0) control timeout alarm
+        CmdGetStatus        -                       Reply: [result, state, volume, alarms,
+                                                    vbat LSB, vbat MSB, queued tones]
+        CmdTelemetry        [period]                Telemetry period in 100ms units, 0 to disable.
+                                                    Telemetry frames are sent with the same reply
+                                                    command: [CmdOk, cmdTelemetry_t]
+        CmdConfig           -                       Reply: [result, config_t]
+        CmdConfig           [config_t]              Set and save settings, see global_def.h
+        CmdDump             -                       Dump whole EEPROM as is (config, status, event log),
+                                                    replies: [result, offset, CMD_DUMP_CHUNK bytes] * n
+                                                    Chunks are sent as soon as TX buffer has space.
+
+    Telemetry is sent by Cmd_ProcessTelemetry() at wake-ups of main loop, so it never wakes CPU
+    by itself, and the actual period is rounded up to the sleep period of current state.
+*/
+
+#define CMD_SYNC                UART_SYNC_BYTE      // Used for autobaud
+#define CMD_REPLY               0x80
+
+// Sync, length, command, CRC
+#define CMD_FRAME_OVERHEAD      4
+
+// Longest UART message, limited by UART RX buffer
+#define CMD_MAX_MESSAGE         32
+
+// Longest pattern bytecode
+#define CMD_MAX_PATTERN         (CMD_MAX_MESSAGE - CMD_FRAME_OVERHEAD)
+
+// EEPROM dump chunk, frame must fit TX buffer
+#define CMD_DUMP_CHUNK          16
+
+// The longest reply data: offset and dump chunk, or telemetry snapshot
+#define CMD_MAX_REPLY_DATA      ((sizeof(cmdTelemetry_t) > 1 + CMD_DUMP_CHUNK) ? sizeof(cmdTelemetry_t) : 1 + CMD_DUMP_CHUNK)
+
+#define CMD_TELEMETRY_UNIT_MS   100
+
+
+typedef enum {
+    CmdPlayPattern = 0x01,
+    CmdPlayTones = 0x02,
+    CmdSetVolume = 0x03,
+    CmdTimeoutAlarm = 0x04,
+    CmdGetStatus = 0x05,
+    CmdTelemetry = 0x06,
+    CmdConfig = 0x07,
+    CmdDump = 0x08,
+} eCmd;
+
+typedef enum {
+    CmdOk,
+    CmdBadArgument,
+    CmdBusy,
+    CmdUnknown,
+} eCmdResult;
+
+
+// Pattern is played from RAM, buffer must be kept while it is being played
+static uint8_t cmdPattern[CMD_MAX_PATTERN + 1];
+
+static struct {
+    uint16_t periodMs;                  // 0 if disabled
+    uint16_t timer;
+} telemetry;
+
+// Offset of the next EEPROM dump chunk, NVM_SIZE if dump is not active
+static uint8_t dumpOffset = NVM_SIZE;
+
+
+
+// Check pattern bytecode, so interpreter never runs out of buffer
+static uint8_t isPatternValid(const uint8_t *data, uint8_t length)
+{
+    uint8_t i = 0;
+
+    while (i < length)
+    {
+        uint8_t op = data[i] & BZP_OP_MASK;
+        uint8_t arg = data[i] & BZP_ARG_MASK;
+
+        if (data[i] == BZP_OP_END)
+            return 1;
+        if (((op == BZP_OP_NOTE) && (arg < ToneCount)) || ((op == BZP_OP_LOOP) && (arg == 0)))
+            i += 2;                                     // Opcode and argument byte
+        else if (((op == BZP_OP_ENDLOOP) && (arg == 0)) || ((op == BZP_OP_VOLUME) && (arg < VolumeCount)))
+            i += 1;
+        else
+            return 0;
+    }
+    return (i == length);
+}
+
+
+static eCmdResult playPattern(const uint8_t *data, uint8_t length)
+{
+    uint8_t i;
+
+    if ((length == 0) || !isPatternValid(data, length))
+        return CmdBadArgument;
+
+    // Pattern being played may use the buffer
+    Buzz_Stop();
+    for (i = 0; i < length; i++)
+        cmdPattern[i] = data[i];
+    cmdPattern[length] = BZP_END;
+    Buzz_PlayPattern(cmdPattern);
+    return CmdOk;
+}
+
+
+static eCmdResult playTones(const uint8_t *data, uint8_t length)
+{
+    uint8_t i;
+
+    if ((length == 0) || (length & 1))
+        return CmdBadArgument;
+    for (i = 0; i < length; i += 2)
+    {
+        if ((data[i] >= ToneCount) || (data[i + 1] == 0))
+            return CmdBadArgument;
+    }
+    if ((length >> 1) > Buzz_GetQueueFree())
+        return CmdBusy;
+
+    for (i = 0; i < length; i += 2)
+        Buzz_PutTone((eTone)data[i], (uint16_t)data[i + 1] * 10);
+    return CmdOk;
+}
+
+
+// Returns 0 if there is no space in TX buffer
+static uint8_t sendReply(uint8_t cmd, uint8_t result, const uint8_t *data, uint8_t length)
+{
+    uint8_t frame[CMD_FRAME_OVERHEAD + 1 + CMD_MAX_REPLY_DATA];
+    uint8_t crc;
+    uint8_t i;
+
+    frame[0] = CMD_SYNC;
+    frame[1] = length + 2;                              // Command and result
+    frame[2] = cmd | CMD_REPLY;
+    frame[3] = result;
+    for (i = 0; i < length; i++)
+        frame[4 + i] = data[i];
+    crc = 0;
+    for (i = 1; i < length + 4; i++)
+        crc = UART_Crc8(crc, frame[i]);
+    frame[length + 4] = crc;
+    return UART_Send(frame, length + CMD_FRAME_OVERHEAD + 1);
+}
+
+
+// Send EEPROM dump chunks while there is space in TX buffer
+static void sendDump(void)
+{
+    uint8_t chunk[1 + CMD_DUMP_CHUNK];
+    uint8_t i;
+
+    while (dumpOffset < NVM_SIZE)
+    {
+        chunk[0] = dumpOffset;
+        for (i = 0; i < CMD_DUMP_CHUNK; i++)
+            chunk[1 + i] = Nvm_ReadByte(dumpOffset + i);
+        if (!sendReply(CmdDump, CmdOk, chunk, sizeof(chunk)))
+            return;
+        dumpOffset += CMD_DUMP_CHUNK;
+    }
+}
+
+
+static void processFrame(uint8_t cmd, const uint8_t *data, uint8_t length)
+{
+    uint8_t reply[CMD_MAX_REPLY_DATA];
+    uint8_t replyLength = 0;
+    eCmdResult result = CmdOk;
+    cmdStatus_t status;
+
+    switch (cmd)
+    {
+        case CmdPlayPattern:
+            result = playPattern(data, length);
+            break;
+        case CmdPlayTones:
+            result = playTones(data, length);
+            break;
+        case CmdSetVolume:
+            if ((length != 1) || (data[0] >= VolumeCount))
+                result = CmdBadArgument;
+            else
+                onCmdSetVolume((eVolume)data[0]);
+            break;
+        case CmdTimeoutAlarm:
+            if ((length != 1) || (data[0] > 1))
+                result = CmdBadArgument;
+            else
+                onCmdTimeoutAlarm(data[0]);
+            break;
+        case CmdGetStatus:
+            onCmdGetStatus(&status);
+            reply[0] = status.state;
+            reply[1] = status.volume;
+            reply[2] = status.alarms;
+            reply[3] = (uint8_t)status.vbatMv;
+            reply[4] = (uint8_t)(status.vbatMv >> 8);
+            reply[5] = Buzz_GetQueueCount();
+            replyLength = 6;
+            break;
+        case CmdTelemetry:
+            if (length != 1)
+            {
+                result = CmdBadArgument;
+            }
+            else
+            {
+                telemetry.periodMs = (uint16_t)data[0] * CMD_TELEMETRY_UNIT_MS;
+                telemetry.timer = 0;
+            }
+            break;
+        case CmdConfig:
+            if (length == 0)
+            {
+                onCmdGetConfig((config_t *)reply);
+                replyLength = sizeof(config_t);
+            }
+            else if ((length != sizeof(config_t)) || !onCmdSetConfig((const config_t *)data))
+            {
+                result = CmdBadArgument;
+            }
+            break;
+        case CmdDump:
+            if (length == 0)
+            {
+                // Chunks are the reply
+                dumpOffset = 0;
+                sendDump();
+                return;
+            }
+            result = CmdBadArgument;
+            break;
+        default:
+            result = CmdUnknown;
+            break;
+    }
+    sendReply(cmd, result, reply, replyLength);
+}
+
+
+/**
+    Process received commands
+
+    Must be called from the same context as Buzz_Process()
+*/
+void Cmd_Process(void)
+{
+    uint8_t msg[CMD_MAX_MESSAGE];
+    uint8_t length;
+    uint8_t frameLength;
+    uint8_t pos;
+    uint8_t crc;
+    uint8_t i;
+
+    while ((length = UART_GetMessage(msg, sizeof(msg))) != 0)
+    {
+        pos = 0;
+        while (pos + CMD_FRAME_OVERHEAD <= length)
+        {
+            frameLength = msg[pos + 1];
+            if ((msg[pos] != CMD_SYNC) || (frameLength == 0))
+            {
+                pos++;                                  // Resync
+                continue;
+            }
+            if (pos + frameLength + 3 > length)
+                break;                                  // Truncated frame
+
+            crc = 0;
+            for (i = 0; i <= frameLength; i++)
+                crc = UART_Crc8(crc, msg[pos + 1 + i]);
+            if (crc != msg[pos + frameLength + 2])
+            {
+                pos++;
+                continue;
+            }
+            processFrame(msg[pos + 2], &msg[pos + 3], frameLength - 1);
+            pos += frameLength + 3;
+        }
+    }
+    sendDump();
+}
+
+
+/**
+    Get status of command processing
+
+    @return 1 if replies are pending, Cmd_Process() must be called periodically
+*/
+uint8_t Cmd_IsBusy(void)
+{
+    return (dumpOffset < NVM_SIZE);
+}
+
+
+/**
+    Send telemetry snapshot if it is enabled and its period has passed
+
+    Must be called at every wake-up of main loop
+    @param elapsedMs Time since previous call
+*/
+void Cmd_ProcessTelemetry(uint16_t elapsedMs)
+{
+    cmdTelemetry_t snapshot;
+
+    if (telemetry.periodMs == 0)
+        return;
+    if (telemetry.timer < telemetry.periodMs)
+        telemetry.timer += elapsedMs;
+    if (telemetry.timer < telemetry.periodMs)
+        return;
+
+    onCmdGetTelemetry(&snapshot);
+    snapshot.queueCount = Buzz_GetQueueCount();
+    telemetry.timer = 0;
+    sendReply(CmdTelemetry, CmdOk, (const uint8_t *)&snapshot, sizeof(snapshot));
+}
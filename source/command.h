@@ -0,0 +1,52 @@
+#ifndef __COMMAND_H__
+#define __COMMAND_H__
+
+#include "global_def.h"
+
+
+// Alarm flags in status reply
+#define CMD_ALARM_DIRECT_CONTROL    (1 << 0)
+#define CMD_ALARM_PWM_CONTROL       (1 << 1)
+#define CMD_ALARM_CONTROL_TIMEOUT   (1 << 2)
+#define CMD_ALARM_DSHOT_BEACON      (1 << 3)
+#define CMD_ALARM_LINK_LOSS         (1 << 4)
+#define CMD_ALARM_TIMEOUT_DISARMED  (1 << 7)
+
+// Device status, filled by main
+typedef struct {
+    uint8_t state;              // bState_t
+    uint8_t volume;             // eVolume
+    uint8_t alarms;             // CMD_ALARM_xxx
+    uint16_t vbatMv;
+} cmdStatus_t;
+
+// Telemetry snapshot, sent as is: STM8 has no alignment padding, multi-byte fields are big-endian
+typedef struct {
+    uint8_t state;              // bState_t
+    uint8_t alarms;             // CMD_ALARM_xxx
+    uint8_t queueCount;         // Queued tones
+    uint16_t vbatMv;
+    uint32_t uptimeMs;
+    uint32_t supplyLossMs;      // Time since main supply loss, 0 while it is present
+    uint8_t resetCause;         // eResetCause of the last reset
+    uint8_t volumeBackoff;      // Volume levels stepped down after brownout resets
+    uint8_t socPercent;         // Battery state of charge, 0xFF while estimate is not valid
+    uint16_t lifetimeMin;       // Projected battery lifetime at average current, 0 while estimate is not valid
+} cmdTelemetry_t;
+
+
+void Cmd_Process(void);
+uint8_t Cmd_IsBusy(void);
+void Cmd_ProcessTelemetry(uint16_t elapsedMs);
+
+// Callbacks, implemented by main
+void onCmdSetVolume(eVolume volume);
+void onCmdTimeoutAlarm(uint8_t isArmed);
+void onCmdGetStatus(cmdStatus_t *status);
+void onCmdGetTelemetry(cmdTelemetry_t *telemetry);
+void onCmdGetConfig(config_t *config);
+uint8_t onCmdSetConfig(const config_t *config);
+
+
+
+#endif  // __COMMAND_H__
@@ -8,85 +8,335 @@
 #include "ctrl_capture.h"
 
 
-typedef enum {
-    CAP_IDLE,
-    CAP_WAIT_FIRST_EDGE,
-    CAP_WAIT_SECOND_EDGE,
-} eCapState;
+/*
+    Control signal decoder, SIG pin is TIM2_CH1 (AFR0).
+    Both CH1 and CH2 capture TI1: CH1 captures leading edge, CH2 captures trailing edge.
+    Counter is free-running, so only CH2 interrupt is used, once per impulse:
+        pulse width = CCR2 - CCR1
+        period = CCR1 - CCR1 of the previous impulse
+    TIM2 has no slave mode controller, so counter can not be reset by leading edge.
+    Period is valid if there was at most one counter overflow between impulses.
+    Impulse is skipped if its leading edge has not been captured (CC1IF is not set), e.g. when
+    counter has been started in the middle of the impulse.
+
+    Supported protocols:
+        - direct level control: SIG is static, level is checked by main loop
+        - RC servo PWM: control value is pulse width
+        - PPM sum signal: control value is period between leading edges of marks ending
+          channel CAP_PPM_CHANNEL, frames are separated by sync gap
+        - DShot150/300 ESC signal: beacon commands are reported, see DShot section below
+    Protocol and polarity are detected by classifier: both edges are captured for
+    CLS_CYCLES signal cycles, then min/max widths of high and low phases are matched against
+    each protocol. Edges faster than ISR can follow (overcapture or phases shorter than
+    PPM mark) are counted as DShot. If no edges are detected for CAP_LOST_OVERFLOWS counter periods, SIG is
+    treated as direct level control. Active level is opposite to idle one, which is sampled
+    at boot classification only, since SIG may be kept at active level by controller later.
+    Pulse polarity also defines active level of direct control.
+
+    Capture can run continuously (startCapture) or in bursts (armCapture):
+    armed capture enables SIG external interrupt and keeps TIM2 stopped, so CPU may stay in active-halt.
+    SIG edge wakes CPU, triggerCapture() is called from EXTI ISR and starts the counter,
+    either decoding detected protocol or classifying signal if protocol is unknown or level.
+    Decoding burst is stopped after CAP_BURST_EDGES trailing edges, that is at least
+    two complete PWM frames, as soon as PPM channel is decoded, or when signal is lost.
+    Filter state is kept between bursts.
+    Signal is lost if capture is armed again without any SIG edge since the previous arming,
+    protocol is switched to direct level control then.
+    If decoding burst has not accepted any frame, protocol is classified again at next edge.
+
+    Pulses out of CAP_MIN_PULSE_US .. CAP_MAX_PULSE_US and frames shorter than CAP_MIN_PERIOD_US
+    are dropped as glitches. Accepted pulse widths are passed through median filter of 3.
+
+    Timers are fed by Fmaster (4MHz, or 16MHz while UART is listening to CRSF)
+    TIM2 does not run in active-halt, so CPU must be kept in WFI while capture is active.
+*/
+
+#define CAP_MIN_PULSE_US        500
+#define CAP_MAX_PULSE_US        2500
+#define CAP_MIN_PERIOD_US       2500        // 400Hz max frame rate
+
+// PPM mark width and minimal sync gap (mark + pause)
+#define CAP_PPM_MIN_MARK_US     100
+#define CAP_PPM_MAX_MARK_US     450
+#define CAP_PPM_MIN_SYNC_US     3000
+
+// Timeout for signal loss, 65.5ms each
+#define CAP_LOST_OVERFLOWS      2
+
+// Minimal time capture stays armed without edges before signal is considered lost [ms]
+// Must exceed the longest valid frame period (CAP_LOST_OVERFLOWS timer periods)
+#define CAP_ARMED_LOST_MS       250
+
+// Trailing edges captured per burst, first frame of a burst is usually incomplete
+#define CAP_BURST_EDGES         3
+
+// PPM frame has up to 16 channels, burst covers two frames
+#define CAP_BURST_PPM_EDGES     34
+
+// Signal cycles measured by classifier
+#define CLS_CYCLES              16
+
+// Fast edges for DShot detection
+#define CLS_FAST_EDGES          8
+
+#define CAP_MEDIAN_SIZE         3
+
+// Prescaler for 1us timebase, Fmaster = 16MHz >> HSIDIV may be raised while UART is listening
+#define CAP_TIMER_PSCR()        ((uint8_t)(4 - ((CLK->CKDIVR & CLK_CKDIVR_HSIDIV) >> 3)))
 
 
 static struct {
-    volatile eCapState state;
-    volatile uint16_t ccr1;
-    volatile uint16_t ccr2;
-    uint8_t firstPol;
-    uint8_t secPol;
+    uint16_t lastRise;
+    uint16_t frameStart;                    // PPM: leading edge after sync gap
+    uint16_t width[CAP_MEDIAN_SIZE];
+    uint8_t widthIndex;
+    uint8_t isRiseValid;                    // lastRise is captured by running counter
+    uint8_t validFrames;                    // Frames accepted in a row, saturated
+    uint8_t ppmChannel;                     // PPM: channel ending at next leading edge, 0xFF if not synchronized
+    uint8_t burstEdges;                     // Trailing edges left in burst, 0 for continuous capture
+    uint8_t burstFrames;                    // Frames accepted in burst
+    uint8_t isClassifying;
+    uint8_t proto;                          // eCtrlProto
+    uint8_t polarity;                       // eCapPolarity
+    uint8_t dshotErrors;                    // DShot frames failed in a row
+    uint8_t dshotBeacon;                    // DShot beacon command received
+    uint16_t armedMs;                       // Time capture has been armed without edges
+    uint32_t dshotTicks;                    // TIM2 ticks since startDshotCapture()
+    uint16_t dshotLastCount;
+    volatile uint8_t overflows;             // Counter overflows since last frame
+    volatile uint8_t isActive;              // Edges have been detected recently
+    volatile uint8_t isArmed;               // Waiting for SIG edge to start burst
+    volatile uint16_t pulseUs;              // Filtered pulse width, 0 if no valid signal
+    volatile uint16_t periodUs;             // Averaged frame period
 } cap;
 
 
-/*
-    Timers are fed by Fmaster (2MHz)
-    Fcpu = Fmaster / CPUDIV[2:0] (1MHz)
-*/
+// Classifier statistics
+static struct {
+    uint16_t lastEdge;
+    uint8_t isEdgeValid;                    // lastEdge is captured by running counter
+    uint8_t inferPolarity;                  // Idle level defines polarity of direct level control
+    uint8_t cycles;
+    uint8_t fastEdges;
+    uint16_t minHigh;
+    uint16_t maxHigh;
+    uint16_t minLow;
+    uint16_t maxLow;
+} cls;
+
 
 
 /**
     Initialize common timer registers
 
+    @param polarity Default polarity of control signal, used until it is detected
 */
-void initCapture(void)
+void initCapture(eCapPolarity polarity)
 {
-    cap.state = CAP_IDLE;
+    cap.isActive = 0;
+    cap.isArmed = 0;
+    cap.pulseUs = 0;
+    cap.proto = CtrlProtoUnknown;
+    cap.polarity = polarity;
 
     // Make sure timer is not running
     TIM2->CR1 = 0;
     TIM2->EGR = 0;
     TIM2->IER = 0;
+    TIM2->CCER1 = 0;                                        // CCMRx can be written only when channel is disabled
     TIM2->CCMR1 =   (4 << TIMx_CCMR1_IC1F_BPOS)     |       // digital filter, see reference manual
                     (0 << TIMx_CCMR1_IC1PSC_BPOS)   |       // 0: no input capture prescaler
-                    (1 << 0);                               // 1: CC1 channel = input, IC1 mapped to TI1FP1
-    
-    TIM2->PSCR = 1;                                         // Prescaler = 2, providing 1us timebase
+                    (1 << TIMx_CCMR1_CC1S_BPOS);            // 1: CC1 channel = input, IC1 mapped to TI1FP1
+    TIM2->CCMR2 =   (4 << TIMx_CCMR2_IC2F_BPOS)     |       // digital filter, see reference manual
+                    (0 << TIMx_CCMR2_IC2PSC_BPOS)   |       // 0: no input capture prescaler
+                    (2 << TIMx_CCMR2_CC2S_BPOS);            // 2: CC2 channel = input, IC2 mapped to TI1FP2
+
+    TIM2->PSCR = 2;                                         // Prescaler = 4, providing 1us timebase
     TIM2->ARRH = 0xFF;                                      // Auto-reload value, set to maximum
     TIM2->ARRL = 0xFF;
 
 }
 
 
-/**
-    Initialize timer and start single impulse capture
-    Timeout is 65536 us
-
-*/
-void startCapture(eCapPolarity polarity)
+// Configure capture polarity, counter is stopped
+// CH1 captures leading edge, CH2 captures trailing edge
+static void configCapture(uint8_t polarity)
 {
-    cap.state = CAP_WAIT_FIRST_EDGE;
-    cap.ccr1 = cap.ccr2 = 0;
-    cap.firstPol = (polarity == CapPosImpulse) ? 0 : 1;
-    cap.secPol = (polarity == CapPosImpulse) ? 1 : 0;
+    uint8_t leadPol = (polarity == CapPosImpulse) ? 0 : 1;
 
     TIM2->CR1 = 0;
     TIM2->IER = 0;
-    
-    TIM2->CCER1 = (cap.firstPol << TIMx_CC1P_BPOS) |        // 0: Capture on rising TI1F of TI2F, 1: capture on falling edge
-                  (1 << TIMx_CC1E_BPOS);                    // 0: Capture disabled, 1: capture enabled
+    TIM2->CCER1 = (leadPol << TIMx_CC1P_BPOS) |             // 0: Capture on rising TI1F of TI2F, 1: capture on falling edge
+                  (1 << TIMx_CC1E_BPOS) |                   // 0: Capture disabled, 1: capture enabled
+                  ((leadPol ^ 1) << TIMx_CC2P_BPOS) |       // Trailing edge
+                  (1 << TIMx_CC2E_BPOS);
+}
+
+
+// Start counter from 0
+static void runCapture(uint8_t ier)
+{
+    cap.overflows = 0;
+    cap.isRiseValid = 0;
+    cap.ppmChannel = 0xFF;
+    cap.burstFrames = 0;
+    cap.isActive = 1;
+    TIM2->PSCR = CAP_TIMER_PSCR();
 
     // Timer prescaler requires UEV to load new value
     // Counter registers are also cleared
     TIM2->EGR = (1 << TIMx_EGR_UG_BPOS);                    // Generate UG event
     TIM2->SR1 = 0;                                          // Clear interrupt flags
     TIM2->SR2 = 0;                                          // Reset overcapture flags
-    TIM2->IER = TIM2_IER_CC1IE | TIM2_IER_UIE;              // Enable interrupts
-    
+    TIM2->IER = ier;                                        // Enable interrupts
+
     // Enable counter
     TIM2->CR1 = (0 << TIMx_CR1_ARPE_BPOS) |                 // 0: ARR registers are not buffered
                 (0 << TIMx_CR1_OPM_BPOS) |                  // 0: counter is not stopped at update event (not implemented in TIM2/TIM3)
-                (0 << TIMx_CR1_URS_BPOS) |                  
+                (1 << TIMx_CR1_URS_BPOS) |                  // 1: UG does not generate interrupt
                 (0 << TIMx_CR1_UDIS_BPOS) |
                 (1 << TIMx_CR1_CEN_BPOS);
 }
 
 
+// Stop counter at the end of burst, halt is allowed
+// Capture is not disabled by stopped counter, so are interrupts
+static void stopBurst(void)
+{
+    TIM2->CR1 = 0;
+    TIM2->IER = 0;
+    cap.burstEdges = 0;
+    cap.isActive = 0;
+}
+
+
+// Start classifier, CH1 captures rising edge, CH2 captures falling edge
+static void runClassifier(void)
+{
+    cls.isEdgeValid = 0;
+    cls.cycles = 0;
+    cls.fastEdges = 0;
+    cls.minHigh = 0xFFFF;
+    cls.maxHigh = 0;
+    cls.minLow = 0xFFFF;
+    cls.maxLow = 0;
+    cap.isClassifying = 1;
+    cap.burstEdges = 0;
+    configCapture(CapPosImpulse);
+    runCapture(TIM2_IER_CC1IE | TIM2_IER_CC2IE | TIM2_IER_UIE);
+}
+
+
+/**
+    Start continuous capture of RC servo PWM
+
+    @param polarity Polarity of control impulses
+*/
+void startCapture(eCapPolarity polarity)
+{
+    cap.validFrames = 0;
+    cap.pulseUs = 0;
+    cap.periodUs = 0;
+    cap.isArmed = 0;
+    cap.burstEdges = 0;
+    cap.isClassifying = 0;
+    cap.proto = CtrlProtoPwm;
+    cap.polarity = polarity;
+    GPIOC->CR2 &= (uint8_t)(~GPC_SIG_PIN);                  // Disable SIG external interrupt
+
+    configCapture(polarity);
+    runCapture(TIM2_IER_CC2IE | TIM2_IER_UIE);
+}
+
+
+/**
+    Start detection of control protocol
+
+    Must be called when controller is supposed to be idle, e.g. after power-up,
+    since idle SIG level defines polarity of direct level control.
+    Classification is done in background, see isCaptureActive() and getCaptureProtocol()
+*/
+void startClassifier(void)
+{
+    cap.validFrames = 0;
+    cap.pulseUs = 0;
+    cap.periodUs = 0;
+    cap.isArmed = 0;
+    cap.proto = CtrlProtoUnknown;
+    cls.inferPolarity = 1;
+    GPIOC->CR2 &= (uint8_t)(~GPC_SIG_PIN);
+
+    runClassifier();
+}
+
+
+/**
+    Arm capture of a burst of frames
+
+    TIM2 is started by the next SIG edge, see triggerCapture()
+    If capture is still armed for CAP_ARMED_LOST_MS, signal is considered lost.
+    Does nothing if burst is running.
+    @param elapsedMs Time since previous call
+*/
+void armCapture(uint16_t elapsedMs)
+{
+    if (cap.isActive || (cap.proto == CtrlProtoDshot))
+        return;                                             // DShot is decoded by pollDshotFrame()
+    if (cap.isArmed)
+    {
+        // Wake-ups may be much shorter than frame period
+        cap.armedMs = (elapsedMs < CAP_ARMED_LOST_MS - cap.armedMs) ? cap.armedMs + elapsedMs : CAP_ARMED_LOST_MS;
+        if (cap.armedMs < CAP_ARMED_LOST_MS)
+            return;
+        if ((cap.proto == CtrlProtoPwm) || (cap.proto == CtrlProtoPpm))
+        {
+            // No edges since arming, SIG is static
+            cap.proto = CtrlProtoLevel;
+            cap.validFrames = 0;
+            cap.pulseUs = 0;
+        }
+    }
+    cap.armedMs = 0;
+    cap.isArmed = 1;
+    GPIOC->CR2 |= GPC_SIG_PIN;                              // Enable SIG external interrupt
+}
+
+
+/**
+    Start armed capture burst
+
+    Must be called from SIG external interrupt handler
+*/
+void triggerCapture(void)
+{
+    if (!cap.isArmed)
+        return;
+    cap.isArmed = 0;
+    GPIOC->CR2 &= (uint8_t)(~GPC_SIG_PIN);                  // Edges are captured by TIM2 now
+
+    if (cap.proto == CtrlProtoPwm)
+    {
+        cap.isClassifying = 0;
+        cap.burstEdges = CAP_BURST_EDGES;
+        configCapture(cap.polarity);
+        runCapture(TIM2_IER_CC2IE | TIM2_IER_UIE);
+    }
+    else if (cap.proto == CtrlProtoPpm)
+    {
+        cap.isClassifying = 0;
+        cap.burstEdges = CAP_BURST_PPM_EDGES;
+        configCapture(cap.polarity);
+        runCapture(TIM2_IER_CC2IE | TIM2_IER_UIE);
+    }
+    else
+    {
+        // Level change or unknown signal
+        cls.inferPolarity = 0;
+        runClassifier();
+    }
+}
+
+
 /**
     Stop capture
 
@@ -96,82 +346,701 @@ void stopCapture(void)
     // Stop timer
     TIM2->CR1 = 0;          // Stop timer
     TIM2->IER = 0;          // Disable interrupts
-    cap.state = CAP_IDLE;
+    GPIOC->CR2 &= (uint8_t)(~GPC_SIG_PIN);
+    cap.isActive = 0;
+    cap.isArmed = 0;
+    cap.pulseUs = 0;
 }
 
 
 /**
-    Get status of current capture
+    Get status of capture
 
-    @return 0 if capture is not active: second edge has been detected or counter is stopped by overflow
+    @return 1 if TIM2 is running and CPU must not enter active-halt
 */
 uint8_t isCaptureActive(void)
 {
-    return (cap.state != CAP_IDLE);
+    return cap.isActive;
 }
 
 
+uint8_t isCaptureArmed(void)
+{
+    return cap.isArmed;
+}
+
 
 /**
-    Get length of a single captured impulse
+    Get detected control protocol
 
-    @return Length of an impulse in us. If capture result is not valid, returns 0
+    @return eCtrlProto value, CtrlProtoUnknown while classification is in progress
+*/
+eCtrlProto getCaptureProtocol(void)
+{
+    return (eCtrlProto)cap.proto;
+}
+
+
+/**
+    Get detected control polarity
+
+    @return CapPosImpulse for positive impulses or active-high direct control
+*/
+eCapPolarity getCapturePolarity(void)
+{
+    return (eCapPolarity)cap.polarity;
+}
+
+
+/**
+    Get filtered pulse width
+
+    @return Length of an impulse (PWM) or channel (PPM) in us. If there is no valid signal, returns 0
 */
 uint16_t getCapturedPulseUs(void)
 {
-    uint16_t time = 0;
-    if ((cap.ccr1 != 0) && (cap.ccr2 != 0))
+    uint16_t time;
+    // 16-bit value is not read atomically, repeat if it has been updated by ISR
+    do {
+        time = cap.pulseUs;
+    } while (time != cap.pulseUs);
+    return time;
+}
+
+
+/**
+    Get frame period
+
+    @return Averaged frame period in us, 0 if not measured yet
+*/
+uint16_t getCapturedPeriodUs(void)
+{
+    uint16_t time;
+    do {
+        time = cap.periodUs;
+    } while (time != cap.periodUs);
+    return time;
+}
+
+
+/**
+    Get frame rate
+
+    @return Frame rate [Hz], 0 if there is no valid signal
+*/
+uint16_t getCaptureFrameRateHz(void)
+{
+    uint16_t period = getCapturedPeriodUs();
+    return ((period != 0) && (getCapturedPulseUs() != 0)) ? (uint16_t)(1000000UL / period) : 0;
+}
+
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c)
+{
+    if (a > b)
     {
-        // Both first and second edges were detected
-        time = cap.ccr2 - cap.ccr1;
+        uint16_t t = a;
+        a = b;
+        b = t;
+    }
+    // a <= b
+    if (c <= a)
+        return a;
+    return (c < b) ? c : b;
+}
+
+
+// Pass accepted value through median filter
+static void acceptValue(uint16_t value)
+{
+    cap.width[cap.widthIndex] = value;
+    if (++cap.widthIndex >= CAP_MEDIAN_SIZE)
+        cap.widthIndex = 0;
+    if (cap.validFrames < CAP_MEDIAN_SIZE)
+        cap.validFrames++;
+    if (cap.validFrames >= CAP_MEDIAN_SIZE)
+        cap.pulseUs = median3(cap.width[0], cap.width[1], cap.width[2]);
+    cap.burstFrames++;
+}
+
+
+//=================================================================//
+// Classifier
+
+
+// Match signal against protocol with given impulse and gap phases
+static uint8_t isPwm(uint16_t minPulse, uint16_t maxPulse, uint16_t minGap)
+{
+    return (minPulse >= CAP_MIN_PULSE_US) && (maxPulse <= CAP_MAX_PULSE_US) &&
+           (minGap >= CAP_MIN_PERIOD_US - minPulse);
+}
+
+
+static uint8_t isPpm(uint16_t minMark, uint16_t maxMark, uint16_t minGap, uint16_t maxGap)
+{
+    // Channels are shorter than PWM frame, sync gap is present
+    return (minMark >= CAP_PPM_MIN_MARK_US) && (maxMark <= CAP_PPM_MAX_MARK_US) &&
+           (minGap >= CAP_MIN_PULSE_US - minMark) && (minGap < CAP_MIN_PERIOD_US - minMark) &&
+           (maxGap >= CAP_PPM_MIN_SYNC_US - maxMark);
+}
+
+
+// Classify signal by measured phases, called when CLS_CYCLES cycles are done
+static void classifySignal(void)
+{
+    if (isPpm(cls.minHigh, cls.maxHigh, cls.minLow, cls.maxLow))
+    {
+        cap.proto = CtrlProtoPpm;
+        cap.polarity = CapPosImpulse;
+    }
+    else if (isPpm(cls.minLow, cls.maxLow, cls.minHigh, cls.maxHigh))
+    {
+        cap.proto = CtrlProtoPpm;
+        cap.polarity = CapNegImpulse;
+    }
+    else if (isPwm(cls.minHigh, cls.maxHigh, cls.minLow))
+    {
+        cap.proto = CtrlProtoPwm;
+        cap.polarity = CapPosImpulse;
+    }
+    else if (isPwm(cls.minLow, cls.maxLow, cls.minHigh))
+    {
+        cap.proto = CtrlProtoPwm;
+        cap.polarity = CapNegImpulse;
+    }
+    else
+    {
+        // Noise, classify again at next edge
+        cap.proto = CtrlProtoUnknown;
+    }
+    cap.validFrames = 0;
+    cap.pulseUs = 0;
+    cap.periodUs = 0;
+    cap.isClassifying = 0;
+    stopBurst();
+}
+
+
+// Edges are too fast for servo PWM or PPM
+static void classifyDshot(void)
+{
+    cap.proto = CtrlProtoDshot;
+    cap.polarity = CapPosImpulse;
+    cap.validFrames = 0;
+    cap.pulseUs = 0;
+    cap.periodUs = 0;
+    cap.dshotErrors = 0;
+    cap.dshotBeacon = 0;
+    cap.isClassifying = 0;
+    stopBurst();
+}
+
+
+// No edges for timeout, SIG is static
+static void classifyLevel(void)
+{
+    if (cls.inferPolarity)
+    {
+        // Controller is idle, active level is opposite
+        cap.polarity = (GPIOC->IDR & GPC_SIG_PIN) ? CapNegImpulse : CapPosImpulse;
+    }
+    cap.proto = CtrlProtoLevel;
+    cap.validFrames = 0;
+    cap.pulseUs = 0;
+    cap.isClassifying = 0;
+    stopBurst();
+}
+
+
+// Process captured edge
+static void classifyEdge(uint16_t time, uint8_t isRise)
+{
+    uint8_t overflows = cap.overflows;
+    uint16_t phase = time - cls.lastEdge;
+
+    // Phase longer than counter period
+    if ((overflows > 1) || ((overflows == 1) && (time >= cls.lastEdge)))
+        phase = 0xFFFF;
+    cap.overflows = 0;
+
+    if (cls.isEdgeValid)
+    {
+        if (isRise)
+        {
+            // Low phase is done, cycle is counted at rising edge
+            if (phase < cls.minLow)
+                cls.minLow = phase;
+            if (phase > cls.maxLow)
+                cls.maxLow = phase;
+            if (cls.maxHigh != 0)
+                cls.cycles++;
+        }
+        else
+        {
+            if (phase < cls.minHigh)
+                cls.minHigh = phase;
+            if (phase > cls.maxHigh)
+                cls.maxHigh = phase;
+        }
+    }
+    cls.lastEdge = time;
+    cls.isEdgeValid = 1;
+
+    if (phase < CAP_PPM_MIN_MARK_US)
+        cls.fastEdges++;
+    if (cls.fastEdges >= CLS_FAST_EDGES)
+        classifyDshot();
+    else if (cls.cycles >= CLS_CYCLES)
+        classifySignal();
+}
+
+
+// Process pending edges in order of capture
+static void processClassifierEdges(void)
+{
+    uint8_t sr1 = TIM2->SR1;
+    uint16_t rise = 0;
+    uint16_t fall = 0;
+
+    if (TIM2->SR2 & ((1 << TIMx_SR2_CC1OF_BPOS) | (1 << TIMx_SR2_CC2OF_BPOS)))
+    {
+        // Overcapture, edges have been missed
+        TIM2->SR2 = 0;
+        cls.isEdgeValid = 0;
+        if (++cls.fastEdges >= CLS_FAST_EDGES)
+        {
+            classifyDshot();
+            return;
+        }
+    }
+
+    // Reading CCRxL clears CCxIF
+    if (sr1 & TIM2_SR1_CC1IF)
+    {
+        rise = (uint16_t)TIM2->CCR1H << 8;
+        rise |= TIM2->CCR1L;
+    }
+    if (sr1 & TIM2_SR1_CC2IF)
+    {
+        fall = (uint16_t)TIM2->CCR2H << 8;
+        fall |= TIM2->CCR2L;
+    }
+
+    if ((sr1 & TIM2_SR1_CC1IF) && (sr1 & TIM2_SR1_CC2IF))
+    {
+        // Both edges are pending, the earlier one is closer to the last edge
+        if ((uint16_t)(rise - cls.lastEdge) < (uint16_t)(fall - cls.lastEdge))
+        {
+            classifyEdge(rise, 1);
+            if (cap.isClassifying)
+                classifyEdge(fall, 0);
+        }
+        else
+        {
+            classifyEdge(fall, 0);
+            if (cap.isClassifying)
+                classifyEdge(rise, 1);
+        }
+    }
+    else if (sr1 & TIM2_SR1_CC1IF)
+    {
+        classifyEdge(rise, 1);
+    }
+    else if (sr1 & TIM2_SR1_CC2IF)
+    {
+        classifyEdge(fall, 0);
     }
-    return time;
 }
 
 
+//=================================================================//
+// DShot
+
+/*
+    DShot bit is 6.67us (DShot150) or 3.33us (DShot300), bit value is coded by high time:
+    37.5% of bit period for 0, 75% for 1. Frame is 16 bits, MSB first:
+        11-bit value, telemetry request bit, 4-bit CRC = XOR of 4-bit nibbles of the first 12 bits
+    Values 1 to 5 are beacon commands, used by flight controller to signal lost model.
+
+    Edges are too fast for capture ISR, so frames are decoded by polling TIM2 capture flags
+    with interrupts disabled. Fmaster is switched to undivided HSI meanwhile, giving
+    16 timer ticks per us and enough CPU cycles per bit. Both edges are captured by hardware,
+    so high time is exact regardless of polling latency, as long as each bit is read
+    before the next one is captured.
+    Frame start is the first rising edge after low gap of DSHOT_MIN_GAP_TICKS, bit period is
+    measured between the first two bits, so both bit rates are decoded.
+    Search for frame start is limited in total, so signal toggling without gaps does not keep
+    interrupts disabled. Overcapture within frame means that a bit has been missed.
+    Interrupts are enabled between frames, pending ones are served in inter-frame gap.
+    Bidirectional (inverted) DShot is not supported.
+*/
+
+#define DSHOT_TICKS_PER_US      16
+#define DSHOT_FRAME_BITS        16
+#define DSHOT_MIN_GAP_TICKS     (DSHOT_TICKS_PER_US * 10)   // 1.5 bit of DShot150
+#define DSHOT_MIN_BIT_TICKS     (DSHOT_TICKS_PER_US * 3)    // DShot300 bit is 3.33us
+#define DSHOT_MAX_BIT_TICKS     (DSHOT_TICKS_PER_US * 8)    // DShot150 bit is 6.67us
+#define DSHOT_CMD_BEACON_FIRST  1
+#define DSHOT_CMD_BEACON_LAST   5
+
+// Wait for frame start, polling cycles in total, about 2.5ms at 16MHz
+#define DSHOT_FRAME_WAIT        5000
+
+// Wait for next edge within frame, polling cycles
+#define DSHOT_EDGE_WAIT         50
+
+// Frames failed in a row before protocol is classified again
+#define DSHOT_MAX_ERRORS        32
+
+
+/**
+    Prepare DShot decoding
+
+    Switches Fmaster to 16MHz, so peripherals clocked by Fmaster must be idle (buzzer, ADC).
+    Must be followed by stopDshotCapture()
+*/
+void startDshotCapture(void)
+{
+    CLK_SYSCLKConfig(CLK_PRESCALER_HSIDIV1);                // Fmaster = 16MHz
+    configCapture(CapPosImpulse);
+    TIM2->PSCR = 0;                                         // Prescaler = 1
+    TIM2->EGR = (1 << TIMx_EGR_UG_BPOS);
+    TIM2->SR1 = 0;
+    TIM2->SR2 = 0;
+    TIM2->CR1 = (1 << TIMx_CR1_URS_BPOS) |
+                (1 << TIMx_CR1_CEN_BPOS);
+    cap.dshotTicks = 0;
+    cap.dshotLastCount = 0;
+}
+
+
+/**
+    Get time spent decoding DShot
+
+    AWU does not count while CPU is polling, so time is counted by TIM2.
+    Must be called at least once per TIM2 wrap (4ms), e.g. after each pollDshotFrame()
+    @return Time since startDshotCapture() [ms]
+*/
+uint16_t getDshotElapsedMs(void)
+{
+    uint16_t count = (uint16_t)TIM2->CNTRH << 8;            // Reading CNTRH latches CNTRL
+    count |= TIM2->CNTRL;
+    cap.dshotTicks += (uint16_t)(count - cap.dshotLastCount);
+    cap.dshotLastCount = count;
+    return (uint16_t)(cap.dshotTicks / (DSHOT_TICKS_PER_US * 1000UL));
+}
+
+
+/**
+    Finish DShot decoding
+
+    Restores Fmaster and TIM2 prescaler
+*/
+void stopDshotCapture(void)
+{
+    TIM2->CR1 = 0;
+    TIM2->PSCR = 2;                                         // Prescaler = 4, providing 1us timebase at 4MHz
+    TIM2->EGR = (1 << TIMx_EGR_UG_BPOS);
+    CLK_SYSCLKConfig(CLK_PRESCALER_HSIDIV4);                // Fmaster = 4MHz
+}
+
+
+// Frame read status
+enum {
+    DshotNoSignal,
+    DshotFrame,
+    DshotError
+};
+
+
+// Capture high time of frame bits, interrupts are disabled
+static uint8_t readDshotFrame(uint8_t *highTicks, uint8_t *bitTicks)
+{
+    uint16_t rise;
+    uint16_t firstRise = 0;
+    uint16_t fall;
+    uint16_t wait;
+    uint8_t isEdge = 0;
+    uint8_t i;
+
+    // Find rising edge after gap
+    TIM2->SR1 = 0;
+    fall = (uint16_t)TIM2->CNTRH << 8;                     // Reading CNTRH latches CNTRL
+    fall |= TIM2->CNTRL;
+    wait = DSHOT_FRAME_WAIT;
+    while (1)
+    {
+        while (!(TIM2->SR1 & TIM2_SR1_CC1IF))
+        {
+            if (--wait == 0)
+                return (isEdge) ? DshotError : DshotNoSignal;
+        }
+        isEdge = 1;
+        rise = (uint16_t)TIM2->CCR1H << 8;
+        rise |= TIM2->CCR1L;
+        if ((uint16_t)(rise - fall) >= DSHOT_MIN_GAP_TICKS)
+            break;
+        while (!(TIM2->SR1 & TIM2_SR1_CC2IF))
+        {
+            if (--wait == 0)
+                return DshotError;
+        }
+        fall = (uint16_t)TIM2->CCR2H << 8;
+        fall |= TIM2->CCR2L;
+    }
+
+    // Capture high time of each bit
+    TIM2->SR2 = 0;
+    for (i = 0; i < DSHOT_FRAME_BITS; i++)
+    {
+        if (i != 0)
+        {
+            wait = DSHOT_EDGE_WAIT;
+            while (!(TIM2->SR1 & TIM2_SR1_CC1IF))
+            {
+                if (--wait == 0)
+                    return DshotError;
+            }
+            rise = (uint16_t)TIM2->CCR1H << 8;
+            rise |= TIM2->CCR1L;
+            if (i == 1)
+                *bitTicks = (uint8_t)(((uint16_t)(rise - firstRise) < 0xFF) ? rise - firstRise : 0xFF);
+        }
+        else
+        {
+            firstRise = rise;
+        }
+        wait = DSHOT_EDGE_WAIT;
+        while (!(TIM2->SR1 & TIM2_SR1_CC2IF))
+        {
+            if (--wait == 0)
+                return DshotError;
+        }
+        fall = (uint16_t)TIM2->CCR2H << 8;
+        fall |= TIM2->CCR2L;
+        if (TIM2->SR2 & ((1 << TIMx_SR2_CC1OF_BPOS) | (1 << TIMx_SR2_CC2OF_BPOS)))
+            return DshotError;                              // Edge has been captured over unread one
+        highTicks[i] = (uint8_t)(((uint16_t)(fall - rise) < 0xFF) ? fall - rise : 0xFF);
+    }
+    return DshotFrame;
+}
+
+
+/**
+    Receive and decode one DShot frame
+
+    Must be called between startDshotCapture() and stopDshotCapture()
+    Takes up to frame interval, interrupts are disabled meanwhile.
+    After DSHOT_MAX_ERRORS failed frames in a row protocol is switched to direct level
+    if there is no signal, or is classified again otherwise.
+    @return Decoded frame value with telemetry bit and CRC, 0 if frame is not received
+*/
+uint16_t pollDshotFrame(void)
+{
+    uint8_t highTicks[DSHOT_FRAME_BITS];
+    uint8_t bitTicks = 0;
+    uint8_t threshold;
+    uint16_t frame = 0;
+    uint16_t crc;
+    uint8_t status;
+    uint8_t i;
+
+    disableInterrupts();
+    status = readDshotFrame(highTicks, &bitTicks);
+    enableInterrupts();
+
+    // Bit is 1 if high time is longer than 9/16 of bit period
+    if ((status == DshotFrame) && (bitTicks >= DSHOT_MIN_BIT_TICKS) && (bitTicks <= DSHOT_MAX_BIT_TICKS))
+    {
+        threshold = (uint8_t)(((uint16_t)bitTicks * 9) >> 4);
+        for (i = 0; i < DSHOT_FRAME_BITS; i++)
+        {
+            frame <<= 1;
+            if (highTicks[i] > threshold)
+                frame |= 1;
+        }
+        crc = (frame >> 4) ^ (frame >> 8) ^ (frame >> 12);
+        if ((crc & 0x0F) == (frame & 0x0F))
+        {
+            cap.dshotErrors = 0;
+            if (((frame >> 5) >= DSHOT_CMD_BEACON_FIRST) && ((frame >> 5) <= DSHOT_CMD_BEACON_LAST))
+                cap.dshotBeacon = 1;
+            return frame;
+        }
+    }
+
+    if (++cap.dshotErrors >= DSHOT_MAX_ERRORS)
+        cap.proto = (status == DshotNoSignal) ? CtrlProtoLevel : CtrlProtoUnknown;
+    return 0;
+}
+
+
+/**
+    Check for DShot beacon command
+
+    @return 1 if beacon command has been received since previous call
+*/
+uint8_t isDshotBeaconReceived(void)
+{
+    uint8_t beacon = cap.dshotBeacon;
+    cap.dshotBeacon = 0;
+    return beacon;
+}
+
+
+/**
+    Check for DShot beacon command without clearing it
+
+    @return 1 if beacon command has been received since isDshotBeaconReceived() call
+*/
+uint8_t isDshotBeaconPending(void)
+{
+    return cap.dshotBeacon;
+}
+
+
+//=================================================================//
+// Interrupt handlers
+
+
 /**
     ISR for TIM2 update/overflow
 
 */
 INTERRUPT_HANDLER(isr_timer2_upd, 13)
 {
-    // No capture happened for timer update interval
-    TIM2->CR1 = 0;          // Stop timer
-    TIM2->IER = 0;          // Disable interrupts
-    cap.state = CAP_IDLE;
+    TIM2->SR1 = (uint8_t)(~TIM2_SR1_UIF);
+    if (cap.overflows < CAP_LOST_OVERFLOWS)
+    {
+        cap.overflows++;
+    }
+    else if (cap.isClassifying)
+    {
+        classifyLevel();
+    }
+    else
+    {
+        // No frames for timeout interval, signal is lost
+        cap.validFrames = 0;
+        cap.isRiseValid = 0;
+        cap.ppmChannel = 0xFF;
+        cap.pulseUs = 0;
+        if (cap.burstEdges != 0)
+            stopBurst();
+    }
+}
+
+
+// Decode PPM frame, called at each mark
+static void decodePpm(uint16_t rise, uint8_t overflows)
+{
+    uint16_t period = rise - cap.lastRise;
+
+    // Period between leading edges of marks is channel value or sync gap
+    if (!cap.isRiseValid || (overflows > 1))
+    {
+        cap.ppmChannel = 0xFF;
+    }
+    else if (period >= CAP_PPM_MIN_SYNC_US)
+    {
+        if (cap.ppmChannel != 0xFF)
+        {
+            period = rise - cap.frameStart;
+            cap.periodUs = (cap.periodUs == 0) ? period : cap.periodUs - (cap.periodUs >> 3) + (period >> 3);
+        }
+        cap.frameStart = rise;
+        cap.ppmChannel = 0;
+    }
+    else if (cap.ppmChannel != 0xFF)
+    {
+        if ((cap.ppmChannel == CAP_PPM_CHANNEL) && (period >= CAP_MIN_PULSE_US) && (period <= CAP_MAX_PULSE_US))
+        {
+            acceptValue(period);
+            if (cap.burstEdges != 0)
+                stopBurst();                                // Channel is decoded, burst is done
+        }
+        if (++cap.ppmChannel == 0xFF)
+            cap.ppmChannel = 0xFE;
+    }
+    cap.lastRise = rise;
+    cap.isRiseValid = 1;
+}
+
+
+// Decode servo PWM frame, called at trailing edge of impulse
+static void decodePwm(uint16_t rise, uint16_t fall, uint8_t overflows)
+{
+    uint16_t width = fall - rise;
+    uint16_t period = rise - cap.lastRise;
+
+    if ((width < CAP_MIN_PULSE_US) || (width > CAP_MAX_PULSE_US))
+        return;                                             // Glitch, previous leading edge is kept
+
+    // Period is unknown for the first frame after counter start or a pause
+    if (cap.isRiseValid && (overflows <= 1))
+    {
+        if (period < CAP_MIN_PERIOD_US)
+            return;                                         // Glitch
+        cap.periodUs = (cap.periodUs == 0) ? period : cap.periodUs - (cap.periodUs >> 3) + (period >> 3);
+    }
+    cap.lastRise = rise;
+    cap.isRiseValid = 1;
+
+    acceptValue(width);
 }
 
 
 /**
     ISR for TIM2 capture
+    Called at trailing edge of each impulse, or at both edges while signal is classified
 
 */
 INTERRUPT_HANDLER(isr_timer2_cap, 14)
 {
-    switch (cap.state)
-    {
-        case CAP_WAIT_FIRST_EDGE:
-            // Get captured value
-            cap.ccr1 = (uint16_t)TIM2->CCR1H;
-            cap.ccr1 = (cap.ccr1 << 8) | TIM2->CCR1L;
-            // Set opposite edge
-            TIM2->CCER1 = (cap.secPol << TIMx_CC1P_BPOS) |  // 0: Capture on rising TI1F of TI2F, 1: capture on falling edge
-                          (1 << TIMx_CC1E_BPOS);            // 0: Capture disabled, 1: capture enabled
-            // Set next state
-            cap.state = CAP_WAIT_SECOND_EDGE;
-            break;
+    uint16_t rise;
+    uint16_t fall;
+    uint8_t overflows = cap.overflows;
+    uint8_t isRiseCaptured = TIM2->SR1 & TIM2_SR1_CC1IF;
 
-        case CAP_WAIT_SECOND_EDGE:
-            // Get captured value
-            cap.ccr2 = (uint16_t)TIM2->CCR1H;
-            cap.ccr2 = (cap.ccr2 << 8) | TIM2->CCR1L;
-            if (TIM2->SR2 & (1 << TIMx_SR2_CC1OF_BPOS))
-                cap.ccr1 = cap.ccr2 = 0;                    // Overcapture, result is not valid
-            TIM2->CR1 = 0;          // Stop timer
-            TIM2->IER = 0;          // Disable interrupts
-            cap.state = CAP_IDLE;
-            break;
+    if (cap.isClassifying)
+    {
+        processClassifierEdges();
+        return;
     }
-}
 
+    // Get captured values, reading CCRxL clears CCxIF
+    rise = (uint16_t)TIM2->CCR1H << 8;
+    rise |= TIM2->CCR1L;
+    fall = (uint16_t)TIM2->CCR2H << 8;
+    fall |= TIM2->CCR2L;
+    cap.overflows = 0;
 
+    if (TIM2->SR2 & ((1 << TIMx_SR2_CC1OF_BPOS) | (1 << TIMx_SR2_CC2OF_BPOS)))
+    {
+        // Overcapture, edges have been missed
+        TIM2->SR2 = 0;
+        cap.validFrames = 0;
+        cap.isRiseValid = 0;
+        cap.ppmChannel = 0xFF;
+    }
+    else if (isRiseCaptured)                                // Otherwise leading edge is before counter start
+    {
+        if (cap.proto == CtrlProtoPpm)
+            decodePpm(rise, overflows);
+        else
+            decodePwm(rise, fall, overflows);
+    }
+
+    if ((cap.burstEdges != 0) && (--cap.burstEdges == 0))
+    {
+        // Burst is done, halt is allowed
+        stopBurst();
+        if (cap.burstFrames == 0)
+        {
+            // Edges are present, but no frame has been accepted, protocol may have changed
+            cap.proto = CtrlProtoUnknown;
+            cap.validFrames = 0;
+            cap.pulseUs = 0;
+        }
+    }
+}
@@ -3,17 +3,43 @@
 
 #include "global_def.h"
 
+// PPM channel used for control, 0-based
+#define CAP_PPM_CHANNEL         5
+
 typedef enum {
     CapPosImpulse = 0,
     CapNegImpulse = 1,
 } eCapPolarity;
 
+// Control protocol at SIG
+typedef enum {
+    CtrlProtoUnknown,
+    CtrlProtoLevel,             // Direct level control
+    CtrlProtoPwm,               // RC servo PWM
+    CtrlProtoPpm,               // PPM sum signal
+    CtrlProtoDshot,             // DShot ESC signal
+} eCtrlProto;
+
 
-void initCapture(void);
+void initCapture(eCapPolarity polarity);
 void startCapture(eCapPolarity polarity);
+void startClassifier(void);
+void armCapture(uint16_t elapsedMs);
+void triggerCapture(void);
 void stopCapture(void);
 uint8_t isCaptureActive(void);
+uint8_t isCaptureArmed(void);
+eCtrlProto getCaptureProtocol(void);
+eCapPolarity getCapturePolarity(void);
+void startDshotCapture(void);
+void stopDshotCapture(void);
+uint16_t pollDshotFrame(void);
+uint16_t getDshotElapsedMs(void);
+uint8_t isDshotBeaconReceived(void);
+uint8_t isDshotBeaconPending(void);
 uint16_t getCapturedPulseUs(void);
+uint16_t getCapturedPeriodUs(void);
+uint16_t getCaptureFrameRateHz(void);
 
 
 
@@ -0,0 +1,206 @@
+/**
+    @brief Battery fuel gauge
+    @author avegawanderer
+*/
+
+#include "global_def.h"
+#include "gauge.h"
+#include "buzzer.h"
+
+
+/*
+    Remaining capacity is initialized from open-circuit voltage when battery operation starts,
+    then consumed charge is counted:
+        - tones, by buzzer (played time * estimated tone current, see PWM_GetCurrentMa())
+        - MCU, by time spent in active-halt and in WFI while tones are played
+    Each new VBAT measurement pulls counted capacity towards voltage-based estimate by
+    1 / 2^GAUGE_VOLTAGE_WEIGHT_LOG2, so errors of both methods do not accumulate.
+
+    Average current is measured over GAUGE_AVG_WINDOW_MS and is used for lifetime projection.
+    Time spent in halt with AWU stopped (ST_SLEEP) is not counted, consumption is negligible there.
+*/
+
+// MCU supply currents [uA], see low-power table in main.cpp
+#define GAUGE_ACTIVE_HALT_UA            70
+#define GAUGE_WFI_UA                    600
+
+// Voltage correction weight
+#define GAUGE_VOLTAGE_WEIGHT_LOG2       6
+
+// Average current window [ms]
+#define GAUGE_AVG_WINDOW_MS             60000UL
+
+// Charge units
+#define UAMS_PER_UAH                    3600000UL
+
+#define GAUGE_CAPACITY_UAH              ((uint32_t)GAUGE_BATTERY_CAPACITY_MAH * 1000)
+#define GAUGE_MAX_LIFETIME_MIN          0xFFFF
+
+
+// Li-Po open-circuit voltage for 0%, 10% ... 100% state of charge [mV]
+static const uint16_t socVoltageMv[] = {
+    3270, 3690, 3730, 3770, 3800, 3840, 3870, 3950, 4020, 4110, 4200
+};
+
+#define SOC_POINTS      (sizeof(socVoltageMv) / sizeof(socVoltageMv[0]))
+
+
+static struct {
+    uint8_t isValid;
+    uint32_t remainingUah;
+    uint32_t consumedUams;          // Consumed charge less than 1 uAh
+    uint16_t lastPlayTimeMs;        // Buzzer counters at the previous call
+    uint32_t lastChargeMaMs;
+    uint32_t windowUams;            // Charge consumed during average current window
+    uint32_t windowMs;
+    uint16_t avgCurrentUa;
+} gauge;
+
+
+
+// State of charge for open-circuit voltage, linear interpolation between points
+static uint8_t getVoltageSoc(uint16_t mv)
+{
+    uint8_t i;
+
+    if (mv <= socVoltageMv[0])
+        return 0;
+    for (i = 1; i < SOC_POINTS; i++)
+    {
+        if (mv < socVoltageMv[i])
+        {
+            return (uint8_t)((i - 1) * 10 + ((uint16_t)(mv - socVoltageMv[i - 1]) * 10) /
+                                            (socVoltageMv[i] - socVoltageMv[i - 1]));
+        }
+    }
+    return 100;
+}
+
+
+/**
+    Invalidate estimate
+
+    Must be called when battery may be charged or replaced, estimate is re-initialized
+    by next voltage measurement
+*/
+void Gauge_Reset(void)
+{
+    gauge.isValid = 0;
+    gauge.lastPlayTimeMs = Buzz_GetPlayTimeMs();
+    gauge.lastChargeMaMs = Buzz_GetChargeMaMs();
+    gauge.consumedUams = 0;
+    gauge.windowUams = 0;
+    gauge.windowMs = 0;
+    gauge.avgCurrentUa = 0;
+}
+
+
+/**
+    Apply battery voltage measurement
+
+    @param vbatMv Battery voltage measured without load [mV]
+*/
+void Gauge_SetVoltage(uint16_t vbatMv)
+{
+    uint32_t voltageUah = (GAUGE_CAPACITY_UAH / 100) * getVoltageSoc(vbatMv);
+
+    if (!gauge.isValid)
+    {
+        gauge.remainingUah = voltageUah;
+        gauge.isValid = 1;
+    }
+    else if (voltageUah > gauge.remainingUah)
+    {
+        gauge.remainingUah += (voltageUah - gauge.remainingUah) >> GAUGE_VOLTAGE_WEIGHT_LOG2;
+    }
+    else
+    {
+        gauge.remainingUah -= (gauge.remainingUah - voltageUah) >> GAUGE_VOLTAGE_WEIGHT_LOG2;
+    }
+}
+
+
+/**
+    Count consumed charge
+
+    Must be called periodically while device is powered from battery
+    @param elapsedMs Time since previous call
+*/
+void Gauge_Process(uint16_t elapsedMs)
+{
+    uint16_t playTimeMs = Buzz_GetPlayTimeMs();
+    uint32_t chargeMaMs = Buzz_GetChargeMaMs();
+    uint16_t toneMs = playTimeMs - gauge.lastPlayTimeMs;
+    uint32_t chargeUams;
+    uint32_t uah;
+
+    // CPU is in WFI while tones are played and in active halt otherwise
+    chargeUams = (chargeMaMs - gauge.lastChargeMaMs) * 1000;
+    chargeUams += (uint32_t)elapsedMs * GAUGE_ACTIVE_HALT_UA;
+    chargeUams += (uint32_t)toneMs * (GAUGE_WFI_UA - GAUGE_ACTIVE_HALT_UA);
+    gauge.lastPlayTimeMs = playTimeMs;
+    gauge.lastChargeMaMs = chargeMaMs;
+
+    // Average current
+    gauge.windowUams += chargeUams;
+    gauge.windowMs += elapsedMs;
+    if (gauge.windowMs >= GAUGE_AVG_WINDOW_MS)
+    {
+        gauge.avgCurrentUa = (uint16_t)(gauge.windowUams / gauge.windowMs);
+        gauge.windowUams = 0;
+        gauge.windowMs = 0;
+    }
+
+    // Remaining capacity
+    gauge.consumedUams += chargeUams;
+    uah = gauge.consumedUams / UAMS_PER_UAH;
+    gauge.consumedUams -= uah * UAMS_PER_UAH;
+    gauge.remainingUah = (gauge.remainingUah > uah) ? gauge.remainingUah - uah : 0;
+}
+
+
+uint8_t Gauge_IsValid(void)
+{
+    return gauge.isValid;
+}
+
+
+/**
+    Get state of charge
+
+    @return Remaining capacity [%]
+*/
+uint8_t Gauge_GetSocPercent(void)
+{
+    uint32_t soc = gauge.remainingUah / (GAUGE_CAPACITY_UAH / 100);
+    return (soc < 100) ? (uint8_t)soc : 100;
+}
+
+
+uint32_t Gauge_GetRemainingUah(void)
+{
+    return gauge.remainingUah;
+}
+
+
+/**
+    Get average current
+
+    @return Current measured over the last window [uA], active-halt current if window is not done yet
+*/
+uint16_t Gauge_GetAverageCurrentUa(void)
+{
+    return (gauge.avgCurrentUa != 0) ? gauge.avgCurrentUa : GAUGE_ACTIVE_HALT_UA;
+}
+
+
+/**
+    Get projected lifetime with current consumption
+
+    @return Time until battery is empty [min]
+*/
+uint16_t Gauge_GetLifetimeMin(void)
+{
+    uint32_t minutes = (gauge.remainingUah * 60) / Gauge_GetAverageCurrentUa();
+    return (minutes < GAUGE_MAX_LIFETIME_MIN) ? (uint16_t)minutes : GAUGE_MAX_LIFETIME_MIN;
+}
@@ -0,0 +1,22 @@
+#ifndef __GAUGE_H__
+#define __GAUGE_H__
+
+#include "global_def.h"
+
+
+// Capacity of backup battery [mAh]
+#define GAUGE_BATTERY_CAPACITY_MAH      150
+
+
+void Gauge_Reset(void);
+void Gauge_SetVoltage(uint16_t vbatMv);
+void Gauge_Process(uint16_t elapsedMs);
+uint8_t Gauge_IsValid(void);
+uint8_t Gauge_GetSocPercent(void);
+uint32_t Gauge_GetRemainingUah(void);
+uint16_t Gauge_GetAverageCurrentUa(void);
+uint16_t Gauge_GetLifetimeMin(void);
+
+
+
+#endif  // __GAUGE_H__
@@ -7,6 +7,15 @@
 // Debug option
 #define ENA_PWM_OUTPUT          1
 
+// Low-power alarm tones generated by BEEP peripheral (runs in active-halt)
+// BEEP output is PD4 (AFR7), which is VREF_SUPP on current PCB, so this option requires
+// a board with buzzer driver connected to PD4
+#define ENA_BEEP_OUTPUT         0
+
+
+// Clocks
+#define F_MASTER_HZ         4000000UL
+
 
 // GPIOA
 #define GPA_LED1_PIN        GPIO_PIN_2     // LED1 and LED2 are swapped on PCB
@@ -74,13 +83,17 @@ typedef enum {
     VolumeCount
 } eVolume;
 
-// Settings
+// Settings, stored in EEPROM
+#define CFG_ALARM_STAGES            4           // Must match alarm schedule in main.cpp
+#define CFG_MAX_ALARM_PERIOD_S      65          // Alarm period is timed in [ms] by 16-bit timer
+
 typedef struct {
     struct {
-        uint8_t directControlActiveHigh : 1;
+        uint8_t directControlActiveHigh : 1;    // Applied at power-up
     } io;
-
-
+    uint8_t volume;                             // eVolume
+    uint8_t ctrlAlarmTimeoutMin;                // Control signal timeout alarm [min]
+    uint8_t alarmPeriodS[CFG_ALARM_STAGES];     // Repetition period of alarm signal for schedule stages [s]
 } config_t;
 
 // FSM logical states
@@ -91,6 +104,7 @@ typedef enum {
     ST_RUN_SETUP_VOLUME,
     ST_PREALARM,
     ST_ALARM,
+    ST_LOW_BATTERY,     // Battery over-discharge, final signal before shutdown
     ST_SLEEP,
 } bState_t;
 
@@ -9,6 +9,13 @@
 #include "buzzer.h"
 #include "buttons.h"
 #include "pwm.h"
+#include "systime.h"
+#include "adc.h"
+#include "gauge.h"
+#include "nvm.h"
+#include "ctrl_capture.h"
+#include "uart.h"
+#include "command.h"
 
 
 //=================================================================//
@@ -16,25 +23,69 @@
 
 #define DFLT_VOLUME                 VolumeHigh      //VolumeSilent VolumeLow VolumeMedium VolumeHigh
 
-// Control signal timeout alarm [ms]
+// Control signal timeout alarm [ms], see config_t
 // If control signal is not changed during this time, alarm is fired
-#define CTRL_ALM_TIMEOUT            (10UL * 60 * 1000)
+#define DFLT_CTRL_ALM_TIMEOUT_MIN   10
+#define CTRL_ALM_TIMEOUT            ((uint32_t)cfg.ctrlAlarmTimeoutMin * 60 * 1000)
+
+// Receiver channel pulse width for PWM control alarm [us]
+// PWM control is used instead of direct level control when valid RC PWM or PPM signal is present at SIG
+#define CTRL_PWM_ALM_THRESHOLD_US   1700
+
+// DShot beacon alarm is kept active for this time after the last beacon command [ms]
+#define CTRL_DSHOT_BEACON_HOLD      (2000UL)
 
 // Repetition period of control signal alarm [ms]
 #define CTRL_ALM_REP_PERIOD         (5000UL)
 
+// Period of alarms and button check in ST_RUN [ms]
+// Main supply, SIG and BTN edges wake CPU immediately, so this is a fallback only
+#define RUN_CHECK_PERIOD            (1000UL)
+
+// Sampling period of RC PWM signal at SIG [ms]
+// Signal is captured in short bursts started by SIG edge, CPU is in active halt between bursts
+#define CAP_SAMPLE_PERIOD           (250UL)
+
+// CRSF stream at UART is probed for CRSF_PROBE_TIME every CRSF_PROBE_PERIOD [ms]
+// When stream is detected, UART listens to it continuously while buzzer is idle
+#define CRSF_PROBE_PERIOD           (5000UL)
+#define CRSF_PROBE_TIME             (100UL)
+
+// Period of battery voltage measurement [ms]
+#define ADC_SCAN_PERIOD             (1000UL)
+
 // Timeout for pre-alarm state [ms]
 // When main power is gone, FSM buzzer enters pre-alarm state and stays there for specified time
 #define PREALM_TIME                 (10000UL)
 
-// Repetition period of alarm signal [ms]
-#define ALM_PERIOD                  (5000UL)
+// Repetition period of pre-alarm beep [ms]
+#define PREALM_BEEP_PERIOD          (1000UL)
+
+// Timeout for volume selection [ms]
+// If button has not been pressed for this time, selected volume level is applied
+#define VOLUME_SETUP_TIME           (1000UL)
+
+// Brownout resets per volume back-off step
+// Peak H-bridge current of a weak battery may reset MCU at each tone start. Volume is stepped down
+// until tones do not cause resets, back-off is cleared when main supply is present.
+#define BROWNOUTS_PER_BACKOFF       2
+
+// Battery over-discharge cutoff [mV]
+// Device shuts down when VBAT is below UV_CUTOFF_MV for UV_CUTOFF_COUNT measurements in a row,
+// and does not start from battery until VBAT recovers above UV_RELEASE_MV
+#define UV_CUTOFF_MV                3300
+#define UV_RELEASE_MV               3500
+#define UV_CUTOFF_COUNT             3
 
-// After this time period of the alarm will be encreased to save battery [ms]
-#define ALM_2ND_STAGE_TIME          (30UL * 60 * 1000)
+// Alarm signal schedule stage, see almSchedule
+typedef struct {
+    uint16_t startMin;          // Stage starts when this time has passed since alarm start [min]
+    uint8_t maxSoc;             // ... or when battery state of charge drops to this level [%]
+    const uint8_t *pattern;     // Alarm signal, may limit volume
+} almStage_t;
 
-// Repetition period of alarm signal during second stage [ms]
-#define ALM_2ND_STAGE_PERIOD        (15000UL)
+// Repetition period of alarm signal for schedule stage [ms], see config_t
+#define ALM_PERIOD_MS(stage)        ((uint16_t)cfg.alarmPeriodS[stage] * 1000)
 
 
 //=================================================================//
@@ -47,53 +98,38 @@ static struct {
     uint16_t tick;
     uint16_t state;
     uint16_t dly;
+    uint16_t adc;
+    uint16_t cap;
+    uint16_t crsf;
     uint32_t alm;
 } timers;
 
 
-static volatile uint8_t sysFlag_TmrTick;
 static bState_t state;
+static uint8_t adcUpdateCount;
+static uint8_t uvCount;                     // Number of VBAT measurements below cutoff in a row
+static volatile uint8_t sysFlag_ExtIrq;     // Set by external interrupts
+static uint16_t crsfListenMs;               // Time spent listening to CRSF since last check
+static uint32_t supplyLossMs;               // Uptime when main supply has been lost
 static uint8_t buzzerVolume = DFLT_VOLUME;
+static eResetCause resetCause;
+static uint8_t volumeBackoff;               // Volume levels stepped down after brownout resets
 
 // Global structure for storing settings
 config_t cfg;
 
+// Alarm state to be resumed after reset
+typedef struct {
+    uint16_t magic;
+    uint8_t state;              // ST_PREALARM or ST_ALARM
+    uint8_t almStage;
+    uint32_t timeMs;            // Time in state: timers.state for ST_PREALARM, timers.alm for ST_ALARM
+    uint8_t crc;                // CRC8 of the fields above
+} resume_t;
 
-//=================================================================//
-// AWU management (used as timebase for FSM)
-// AWU is active only when CPU is executing power-saving instructions, WFI or HALT
-// The cycle time will depend on the time CPU works in active mode
-// So when used as system timer, it is not as accurate as normal timer
-
-#define AWU_1MS     ((3 << 8) | (32 - 2))
-#define AWU_10MS    ((6 << 8) | (40 - 2))
-#define AWU_100MS   ((9 << 8) | (50 - 2))
-
-
-void setAwuPeriod(uint16_t period)
-{
-    // Set the TimeBase
-    AWU->TBR &= (uint8_t)(~AWU_TBR_AWUTB);
-    AWU->TBR |= (uint8_t)(period >> 8);
+#define RESUME_MAGIC                0xA1A5
 
-    // Set the APR divider
-    AWU->APR &= (uint8_t)(~AWU_APR_APR);
-    AWU->APR |= (uint8_t)(period & 0x3F);
-}
-
-
-void startAwu(uint16_t period)
-{
-	AWU->CSR |= AWU_CSR_AWUEN;
-	setAwuPeriod(period);
-}
-
-
-void stopAwu(void)
-{
-    AWU->CSR &= (uint8_t)(~AWU_CSR_AWUEN);
-    AWU->TBR = (uint8_t)(~AWU_TBR_AWUTB);
-}
+static __no_init resume_t resume;
 
 
 //=================================================================//
@@ -142,14 +178,19 @@ void initGpio(void)
     // SIG
     GPIO_Init(GPIOC, GPC_SIG_PIN, GPIO_MODE_IN_FL_NO_IT);
 
+    // SIG is the only interrupt source at PortC
+    EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOC, EXTI_SENSITIVITY_RISE_FALL);
+
     // UART
     GPIO_Init(GPIOD, GPD_UART_PIN, GPIO_MODE_IN_FL_NO_IT);
 
-    // VBAT, VREF
-    //GPIO_Init(GPIOD, (GPIO_Pin_TypeDef)(GPD_VBAT_PIN | GPD_VREF_PIN), GPIO_MODE_IN_FL_NO_IT);
-    GPIO_Init(GPIOD, (GPIO_Pin_TypeDef)(GPD_VBAT_PIN | GPD_VREF_PIN), GPIO_MODE_OUT_PP_LOW_FAST);       // TODO - replace with analog input
+    // UART is the only interrupt source at PortD, start bit of sync byte triggers autobaud
+    EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOD, EXTI_SENSITIVITY_FALL_ONLY);
+
+    // VBAT, VREF - analog inputs, digital buffers are disabled by ADC
+    GPIO_Init(GPIOD, (GPIO_Pin_TypeDef)(GPD_VBAT_PIN | GPD_VREF_PIN), GPIO_MODE_IN_FL_NO_IT);
 
-    // VREF_SUPP
+    // VREF_SUPP - enabled by ADC during scan only
     GPIO_Init(GPIOD, GPD_VREF_SUPP_PIN, GPIO_MODE_OUT_PP_LOW_FAST);
 
     // PWM outputs
@@ -184,7 +225,8 @@ uint8_t isMainSupplyPresent(void)
 uint8_t isDirectControlInputActive(void)
 {
     uint8_t pinState = (GPIOC->IDR & GPC_SIG_PIN);
-    return (cfg.io.directControlActiveHigh) ? pinState : !pinState;
+    // Polarity is detected by capture classifier
+    return (getCapturePolarity() == CapPosImpulse) ? pinState : !pinState;
 }
 
 
@@ -223,10 +265,268 @@ void LP_HALT_SYSTMR(uint8_t numTicks)
 }
 
 
+// Wait in WFI while buzzer is playing tone sequence from TIM1
+// Tones are timed by TIM1, so AWU tick is not required meanwhile and is stopped.
+// CPU is woken by tone interrupts, BTN, VCC_SEN and SIG (if enabled) edges only.
+// Returns when sequence is done or BTN, main supply or SIG state changes.
+// Returns elapsed time [ms]
+uint16_t LP_WFI_BUZZER(void)
+{
+    uint16_t startMs = Buzz_GetPlayTimeMs();
+    btn_type_t btnState = GetRawButtonState();
+    uint8_t supplyState = isMainSupplyPresent();
+    uint8_t sigState = isDirectControlInputActive();
+    uint16_t elapsedMs;
+
+    stopAwu();
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_IT);
+    // SIG level is used for direct level control only
+    // Conditions are checked with interrupts disabled: AWU is stopped, so tone end interrupt between
+    // the check and WFI would leave CPU asleep. WFI enables interrupts and wakes at once then.
+    disableInterrupts();
+    while (!Buzz_IsHaltAllowed() && !Buzz_IsContinuousBeep() &&
+           (GetRawButtonState() == btnState) && (isMainSupplyPresent() == supplyState) &&
+           ((getCaptureProtocol() != CtrlProtoLevel) || isCaptureActive() || (isDirectControlInputActive() == sigState)))
+    {
+        asm("WFI");
+        disableInterrupts();
+    }
+    enableInterrupts();
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_NO_IT);
+    startAwu(AWU_10MS);
+
+    // Time is counted by TIM1 at the end of each tone
+    elapsedMs = (uint16_t)(Buzz_GetPlayTimeMs() - startMs);
+    SysTime_Advance(elapsedMs);
+    return elapsedMs;
+}
+
+
+// Active halt until deadline, BTN, VCC_SEN or SIG (if enabled) edge
+// AWU is set to the longest period not exceeding deadline, so far deadlines are reached in a few wake-ups.
+// If CPU is woken by external interrupt, elapsed time is unknown and is not counted by system time.
+// This is acceptable since these events either change FSM state or restart state timer.
+// Continuous tone, control signal capture and UART transfers require Fmaster, so WFI is used instead of halt meanwhile.
+// Capture burst may be started by SIG edge at any time, CPU returns to halt as soon as it is done.
+// If isCmdWake is set, received UART message ends the sleep, so commands are answered immediately.
+// It must be set only by states that process commands, otherwise unread message would end each sleep at once.
+// UART is stopped in halt, edge at UART pin wakes CPU, which then stays in WFI while UART_IsBusy(), see uart.cpp.
+// EEPROM is not written in halt, WFI is used while background write is in progress.
+// Returns elapsed time [ms]
+uint16_t LP_HALT_DEADLINE(uint16_t ms, uint8_t isCmdWake)
+{
+    uint32_t startMs;
+
+    if (ms == 0)
+        return 0;
+    startMs = SysTime_GetMs();
+    // ADC requires HSI, finish scan before halt
+    Adc_WaitScanDone();
+    setAwuPeriodMs(ms);
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_IT);
+    sysFlag_TmrTick = 0;
+    sysFlag_ExtIrq = 0;
+    // Capture and UART interrupts are processed in ISR, main loop is run once per deadline or external event
+    // Conditions are checked with interrupts disabled: HALT and WFI enable them, so an interrupt
+    // between the check and sleep wakes CPU at once
+    disableInterrupts();
+    while (!sysFlag_TmrTick && !sysFlag_ExtIrq && !(isCmdWake && UART_IsMessageReady()))
+    {
+        if (Buzz_IsHaltAllowed() && !isCaptureActive() && !UART_IsBusy() && !Nvm_IsBusy())
+            asm("HALT");
+        else
+            asm("WFI");
+        disableInterrupts();
+    }
+    enableInterrupts();
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_NO_IT);
+    return (uint16_t)(SysTime_GetMs() - startMs);
+}
+
+
+// Decode DShot frames at SIG until deadline, beacon command, BTN or VCC_SEN edge
+// CPU is running at 16MHz meanwhile, this is acceptable since device is powered from main supply.
+// Buzzer and UART must be idle, since Fmaster is changed. UART driver is suspended meanwhile.
+// CPU is polling and AWU does not count, so time is counted by capture timer and added to system time.
+// Returns elapsed time [ms]
+uint16_t LP_DSHOT_DEADLINE(uint16_t ms)
+{
+    uint16_t elapsedMs = 0;
+
+    if (ms == 0)
+        return 0;
+    // ADC clock would exceed its limit at 16MHz
+    Adc_WaitScanDone();
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_IT);
+    sysFlag_ExtIrq = 0;
+    UART_Suspend();
+    startDshotCapture();
+    while (!sysFlag_ExtIrq && (elapsedMs < ms) && (getCaptureProtocol() == CtrlProtoDshot))
+    {
+        pollDshotFrame();
+        elapsedMs = getDshotElapsedMs();
+        // Beacon alarm is started at once
+        if (isDshotBeaconPending())
+            break;
+    }
+    stopDshotCapture();
+    UART_Resume();
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_NO_IT);
+    SysTime_Advance(elapsedMs);
+    return elapsedMs;
+}
+
+
+// Listen to CRSF stream until deadline, BTN or VCC_SEN edge
+// Fmaster is raised to 16MHz and CPU is in WFI meanwhile, buzzer must be idle.
+// Capture burst started by SIG edge uses prescaler for 16MHz, so it is finished before Fmaster is restored.
+// Returns elapsed time [ms]
+uint16_t LP_CRSF_DEADLINE(uint16_t ms)
+{
+    uint32_t startMs;
+
+    if (ms == 0)
+        return 0;
+    startMs = SysTime_GetMs();
+    // ADC clock would exceed its limit at 16MHz
+    Adc_WaitScanDone();
+    setAwuPeriodMs(ms);
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_IT);
+    sysFlag_TmrTick = 0;
+    sysFlag_ExtIrq = 0;
+    UART_StartCrsf();
+    disableInterrupts();
+    while ((!sysFlag_TmrTick && !sysFlag_ExtIrq) || isCaptureActive())
+    {
+        asm("WFI");
+        disableInterrupts();
+    }
+    enableInterrupts();
+    UART_StopCrsf();
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)(GPB_BTN_PIN | GPB_VCCSEN_PIN), GPIO_MODE_IN_FL_NO_IT);
+    crsfListenMs += (uint16_t)(SysTime_GetMs() - startMs);
+    return (uint16_t)(SysTime_GetMs() - startMs);
+}
+
+
+// Limit sleep time for events that require periodic processing:
+// button debounce and release, tones started or timed by Buzz_Process(), EEPROM write, EEPROM dump
+uint16_t limitSleepTime(uint16_t ms)
+{
+    if ((buttons.raw_state != 0) || Buzz_IsActive() || Nvm_IsBusy() || Cmd_IsBusy())
+    {
+        if (ms > BUZZER_FSM_CALL_PERIOD_MS)
+            ms = BUZZER_FSM_CALL_PERIOD_MS;
+    }
+    return ms;
+}
+
+
+// Play queued tones till the end
+void LP_PLAY_BUZZER(void)
+{
+    setAwuPeriod(AWU_10MS);
+    while (Buzz_IsActive())
+    {
+        LP_WFI_SYSTMR(1);
+        Buzz_Process();
+    }
+}
+
+
+// Start battery voltage measurement periodically and apply results, count consumed charge
+// Scan is done in background, results are ready after next sleep
+void processBattery(uint16_t elapsedMs)
+{
+    adcResult_t adc;
+    uint8_t updateCount;
+
+    timers.adc += elapsedMs;
+    if (timers.adc >= ADC_SCAN_PERIOD)
+    {
+        timers.adc = 0;
+        Adc_StartScan();
+    }
+
+    // Battery is not used while main supply is present
+    if (state != ST_RUN)
+        Gauge_Process(elapsedMs);
+
+    updateCount = Adc_GetResult(&adc);
+    if (updateCount != adcUpdateCount)
+    {
+        adcUpdateCount = updateCount;
+        // Keep loudness independent of battery voltage
+        PWM_SetSupplyVoltage(adc.vbatMv);
+        if (state != ST_RUN)
+        {
+            Gauge_SetVoltage(adc.vbatMv);
+            if (adc.vbatMv >= UV_CUTOFF_MV)
+                uvCount = 0;
+            else if (uvCount < UV_CUTOFF_COUNT)
+                uvCount++;
+        }
+    }
+}
+
+
+uint8_t isBatteryCritical(void)
+{
+    return (uvCount >= UV_CUTOFF_COUNT);
+}
+
+
+// Measure battery voltage, blocks for scan time
+uint16_t measureVbatMv(void)
+{
+    adcResult_t adc;
+
+    Adc_StartScan();
+    Adc_WaitScanDone();
+    adcUpdateCount = Adc_GetResult(&adc);
+    return adc.vbatMv;
+}
+
+
+// Alarm resume record is kept in RAM through resets, mostly caused by battery sag under buzzer load.
+// Power-on reset leaves random RAM content, so magic and CRC do not match then.
+uint8_t getResumeCrc(void)
+{
+    const uint8_t *data = (const uint8_t *)&resume;
+    uint8_t crc = 0;
+    uint8_t i;
+
+    for (i = 0; i < sizeof(resume_t) - 1; i++)
+        crc = UART_Crc8(crc, data[i]);
+    return crc;
+}
+
+
+void saveResume(uint8_t resumeState, uint8_t stage, uint32_t timeMs)
+{
+    resume.magic = RESUME_MAGIC;
+    resume.state = resumeState;
+    resume.almStage = stage;
+    resume.timeMs = timeMs;
+    resume.crc = getResumeCrc();
+}
+
+
+uint8_t isResumeValid(void)
+{
+    return (resume.magic == RESUME_MAGIC) && (resume.crc == getResumeCrc()) &&
+           ((resume.state == ST_PREALARM) || (resume.state == ST_ALARM)) && (resume.almStage < CFG_ALARM_STAGES);
+}
+
+
 // Switch state of the FSM
 // PWM outputs and LEDs are disabled
 void swState(bState_t newState)
 {
+    // Only alarm states are resumed after reset
+    if ((newState != ST_PREALARM) && (newState != ST_ALARM))
+        resume.magic = 0;
+
     state = newState;
     timers.tick = 0;
     timers.state = 0;
@@ -261,9 +561,29 @@ static struct {
         // Private
     } directControl;
 
+    // Alarm for PWM control
+    struct {
+        uint8_t isActive;
+        // Private
+    } pwmControl;
+
+    // Alarm for CRSF link loss
+    struct {
+        uint8_t isActive;
+        // Private
+    } linkLoss;
+
+    // Alarm for DShot beacon command
+    struct {
+        uint8_t isActive;
+        // Private
+        uint16_t timer;
+    } dshotBeacon;
+
     // Alarm for control timeout
     struct {
         uint8_t isActive;
+        uint8_t isDisarmed;         // By command, kept through reset_alarms()
         // Private
         uint32_t timer;
     } controlTimeout;
@@ -275,85 +595,251 @@ static struct {
 void reset_alarms(void)
 {
     alarms.directControl.isActive = 0;
+    alarms.pwmControl.isActive = 0;
+    alarms.dshotBeacon.isActive = 0;
+    alarms.dshotBeacon.timer = CTRL_DSHOT_BEACON_HOLD;
+    alarms.linkLoss.isActive = 0;
     alarms.controlTimeout.isActive = 0;
     alarms.controlTimeout.timer = 0;
-    alarms.repeatTimer = 0;
+    alarms.repeatTimer = CTRL_ALM_REP_PERIOD;     // Emit alarm signal on first entry
 }
 
 
-void check_alarms(void)
+void check_alarms(uint16_t elapsedMs)
 {
     uint8_t prevState;
+    uint16_t pulseUs = getCapturedPulseUs();
 
-    // Direct control alarm
-    prevState = alarms.directControl.isActive;
-    alarms.directControl.isActive = isDirectControlInputActive();
-    if (alarms.directControl.isActive != prevState)
+    prevState = alarms.directControl.isActive | (alarms.pwmControl.isActive << 1) |
+                (alarms.dshotBeacon.isActive << 2) | (alarms.linkLoss.isActive << 3);
+
+    // PWM control alarm, receiver channel value
+    alarms.pwmControl.isActive = (pulseUs >= CTRL_PWM_ALM_THRESHOLD_US);
+
+    // Direct control alarm, SIG level is meaningless unless SIG is classified as level control
+    alarms.directControl.isActive = (getCaptureProtocol() == CtrlProtoLevel) && isDirectControlInputActive();
+
+    // DShot beacon alarm, flight controller repeats beacon commands while model is lost
+    if (isDshotBeaconReceived())
+        alarms.dshotBeacon.timer = 0;
+    else if (alarms.dshotBeacon.timer < CTRL_DSHOT_BEACON_HOLD)
+        alarms.dshotBeacon.timer += elapsedMs;
+    alarms.dshotBeacon.isActive = (alarms.dshotBeacon.timer < CTRL_DSHOT_BEACON_HOLD);
+
+    // CRSF link loss alarm, loss is detected by listening time only
+    alarms.linkLoss.isActive = (UART_ProcessCrsf(crsfListenMs) == CrsfLinkLost);
+    crsfListenMs = 0;
+
+    if ((alarms.directControl.isActive | (alarms.pwmControl.isActive << 1) |
+        (alarms.dshotBeacon.isActive << 2) | (alarms.linkLoss.isActive << 3)) != prevState)
     {
         // Reset timeout alarm
         alarms.controlTimeout.timer = 0;
         alarms.controlTimeout.isActive = 0;
+        alarms.repeatTimer = CTRL_ALM_REP_PERIOD;
+        return;
     }
 
     // Control timeout alarm
-    if (alarms.controlTimeout.timer < CTRL_ALM_TIMEOUT)
+    // Alarm is activated at the same call when timeout expires, CPU sleeps until that deadline
+    if (alarms.controlTimeout.isDisarmed)
+        alarms.controlTimeout.timer = 0;
+    else if (alarms.controlTimeout.timer < CTRL_ALM_TIMEOUT)
+        alarms.controlTimeout.timer += elapsedMs;
+    alarms.controlTimeout.isActive = (alarms.controlTimeout.timer >= CTRL_ALM_TIMEOUT);
+}
+
+
+// Get time until the nearest alarm deadline: control timeout, next alarm signal or beacon alarm end
+uint32_t get_alarms_deadline(void)
+{
+    uint32_t deadline;
+
+    if (!alarms.controlTimeout.isActive && !alarms.dshotBeacon.isActive && !alarms.linkLoss.isActive)
+        return CTRL_ALM_TIMEOUT - alarms.controlTimeout.timer;
+    deadline = (alarms.repeatTimer < CTRL_ALM_REP_PERIOD) ? CTRL_ALM_REP_PERIOD - alarms.repeatTimer : 0;
+    if (alarms.dshotBeacon.isActive && (deadline > CTRL_DSHOT_BEACON_HOLD - alarms.dshotBeacon.timer))
+        deadline = CTRL_DSHOT_BEACON_HOLD - alarms.dshotBeacon.timer;
+    return deadline;
+}
+
+
+// Alarm patterns, see buzzer.h for bytecode description
+static const uint8_t alarm1[] = {
+    BZP_LOOP(5),
+        BZP_NOTE(Tone4, 2),
+        BZP_NOTE(Tone1, 2),
+    BZP_ENDLOOP,
+    BZP_END
+};
+
+
+static const uint8_t alarm2[] = {
+    BZP_NOTE(Tone2, 10),
+    BZP_REST(10),
+    BZP_NOTE(Tone2, 10),
+    BZP_NOTE(Tone1, 10),
+    BZP_REST(10),
+    BZP_NOTE(Tone1, 10),
+    BZP_END
+};
+
+
+static const uint8_t alarm3[] = {
+    BZP_LOOP(3),
+        BZP_NOTE(Tone4, 5),
+        BZP_NOTE(Tone1, 8),
+    BZP_ENDLOOP,
+    BZP_END
+};
+
+
+static const uint8_t alarm4[] = {
+    BZP_NOTE(Tone4, 5),
+    BZP_NOTE(Tone1, 8),
+    BZP_END
+};
+
+
+static const uint8_t alarm5[] = {
+    BZP_VOLUME(VolumeMedium),
+    BZP_NOTE(Tone4, 5),
+    BZP_NOTE(Tone1, 8),
+    BZP_END
+};
+
+
+// Battery critical, played once before shutdown
+static const uint8_t alarmBatteryCritical[] = {
+    BZP_LOOP(3),
+        BZP_NOTE(Tone4, 10),
+        BZP_NOTE(Tone2, 10),
+        BZP_NOTE(Tone3, 20),
+        BZP_REST(20),
+    BZP_ENDLOOP,
+    BZP_END
+};
+
+
+// Alarm signal is thinned out with time and battery discharge to keep buzzer audible as long as possible.
+// Stages are switched forward only, periods are set by config.
+// Medium volume gives about twice the audible time per charge of high volume, while idle current
+// between signals is wasted, so late stages lower volume rather than stretch period much.
+// Keep tools/alarm_lifetime.py in sync when changing the schedule or default periods.
+static const almStage_t almSchedule[CFG_ALARM_STAGES] = {
+    // Start [min]      Max SoC [%]     Pattern
+    {  0,               100,            alarm3 },
+    {  30,              60,             alarm3 },
+    {  120,             30,             alarm4 },
+    {  360,             10,             alarm5 }
+};
+
+#define ALM_STAGE_COUNT     (sizeof(almSchedule) / sizeof(almSchedule[0]))
+
+
+// Default settings, used if there is no valid record in EEPROM
+static const config_t cfgDefault = {
+    // io.directControlActiveHigh, volume, ctrlAlarmTimeoutMin, alarmPeriodS
+    {0}, DFLT_VOLUME, DFLT_CTRL_ALM_TIMEOUT_MIN, {5, 15, 20, 30}
+};
+
+
+// Get schedule stage for time since alarm start and battery state
+uint8_t get_alarm_stage(uint8_t stage)
+{
+    uint16_t minutes = (uint16_t)(timers.alm / 60000UL);
+    uint8_t soc = (Gauge_IsValid()) ? Gauge_GetSocPercent() : 100;
+
+    while ((stage + 1 < ALM_STAGE_COUNT) &&
+           ((minutes >= almSchedule[stage + 1].startMin) || (soc <= almSchedule[stage + 1].maxSoc)))
     {
-        alarms.controlTimeout.timer++;
-        alarms.controlTimeout.isActive = 0;
+        stage++;
     }
-    else
+    return stage;
+}
+
+uint8_t isConfigValid(const config_t *config)
+{
+    uint8_t i;
+
+    if ((config->volume >= VolumeCount) || (config->ctrlAlarmTimeoutMin == 0))
+        return 0;
+    for (i = 0; i < CFG_ALARM_STAGES; i++)
     {
-        alarms.controlTimeout.isActive = 1;
+        if ((config->alarmPeriodS[i] == 0) || (config->alarmPeriodS[i] > CFG_MAX_ALARM_PERIOD_S))
+            return 0;
     }
+    return 1;
 }
 
 
-void alarm1(void)
+// Load settings from EEPROM, defaults are used if there is no valid record
+void loadConfig(void)
 {
-    Buzz_PutTone(Tone4, 20);
-    Buzz_PutTone(Tone1, 20);
-    Buzz_PutTone(Tone4, 20);
-    Buzz_PutTone(Tone1, 20);
-    Buzz_PutTone(Tone4, 20);
-    Buzz_PutTone(Tone1, 20);
-    Buzz_PutTone(Tone4, 20);
-    Buzz_PutTone(Tone1, 20);
-    Buzz_PutTone(Tone4, 20);
-    Buzz_PutTone(Tone1, 20);
+    if (!Nvm_LoadConfig(&cfg) || !isConfigValid(&cfg))
+        cfg = cfgDefault;
+    buzzerVolume = cfg.volume;
 }
 
 
-void alarm2(void)
+// Classify, log and count reset cause
+// Must be called before PWM is used, see PWM_IsResetDuringTone()
+void processResetCause(void)
 {
-    Buzz_PutTone(Tone2, 100);
-    Buzz_PutTone(ToneSilence, 100);
-    Buzz_PutTone(Tone2, 100);
-    Buzz_PutTone(Tone1, 100);    
-    Buzz_PutTone(ToneSilence, 100);
-    Buzz_PutTone(Tone1, 100); 
+    uint8_t flags = RST->SR;
+    uint8_t brownouts;
+
+    // Flags are cleared by writing 1
+    RST->SR = flags & (RST_SR_EMCF | RST_SR_SWIMF | RST_SR_ILLOPF | RST_SR_IWDGF | RST_SR_WWDGF);
+
+    if (flags & RST_SR_SWIMF)
+        resetCause = ResetSwim;
+    else if (flags & RST_SR_IWDGF)
+        resetCause = ResetIwdg;
+    else if (flags & RST_SR_WWDGF)
+        resetCause = ResetWwdg;
+    else if (flags & RST_SR_ILLOPF)
+        resetCause = ResetIllegalOpcode;
+    else if (flags & RST_SR_EMCF)
+        resetCause = ResetEmc;
+    else if (PWM_IsResetDuringTone())
+        resetCause = ResetBrownout;
+    else
+        resetCause = ResetPowerOn;
+
+    Nvm_LogEvent(NvmEvtReset, resetCause);
+    Nvm_IncrementCounter(NVM_ADDR_RESET_COUNTERS + resetCause);
+
+    // Step volume down if buzzer keeps resetting the MCU, until main supply is back
+    if (resetCause == ResetBrownout)
+        brownouts = Nvm_IncrementCounter(NVM_ADDR_BROWNOUTS);
+    else
+        brownouts = Nvm_ReadByte(NVM_ADDR_BROWNOUTS);
+    volumeBackoff = brownouts / BROWNOUTS_PER_BACKOFF;
+    if (volumeBackoff > VolumeHigh - VolumeLow)
+        volumeBackoff = VolumeHigh - VolumeLow;
+    PWM_SetVolumeBackoff(volumeBackoff);
 }
 
 
-void alarm3(void)
+// Save settings if changed, EEPROM is written in background by Nvm_Process()
+void saveConfig(void)
 {
-    Buzz_PutTone(Tone4, 50);
-    Buzz_PutTone(Tone1, 80);    
-    Buzz_PutTone(Tone4, 50);
-    Buzz_PutTone(Tone1, 80); 
-    Buzz_PutTone(Tone4, 50);
-    Buzz_PutTone(Tone1, 80); 
+    cfg.volume = buzzerVolume;
+    Nvm_SaveConfig(&cfg);
 }
 
+
 /*
  TODO:
     + PWM dead time (mute level), frequency
     + Buzzer signal queue
-    - UART RX/TX, autobaud
+    + UART RX/TX, autobaud
     + PWM input capture
-    - VREF ADC check
-    - VBAT ADC check
+    + VREF ADC check
+    + VBAT ADC check
     + SWIM pull-up
-    - EEPROM CFG
+    + EEPROM CFG
 
 Low-power:
      WFI (1MHz CPU, HSI 16MHz) - 600uA
@@ -365,12 +851,19 @@ Low-power:
 
 int main()
 {   
-    uint16_t almPeriod;
+    uint8_t almStage = 0;
+    uint16_t sleepMs;
+    uint16_t elapsedMs;
 
     CLK_SYSCLKConfig(CLK_PRESCALER_HSIDIV4);    // Fmaster = 4MHz
     CLK_SYSCLKConfig(CLK_PRESCALER_CPUDIV1);    // Fcpu = 4MHz
     
     initGpio();
+
+    // Settings are used by most modules
+    Nvm_Init();
+    loadConfig();
+    processResetCause();
     Buzz_Init((eVolume)buzzerVolume);
 
     // Simple greeting for initial power-on
@@ -378,14 +871,22 @@ int main()
       
     // Enable LSI
     CLK_LSICmd(ENABLE);
+    while (CLK_GetFlagStatus(CLK_FLAG_LSIRDY) == RESET);
+
+    // System time, LSI frequency is measured
+    SysTime_Init();
+
+    // Calibrate BEEP divider for low-power alarm tones
+    PWM_InitLowPower(SysTime_GetLsiFreq());
 
     // Setup ADC
-    //ADC1_PrescalerConfig(ADC1_PRESSEL_FCPU_D4);
+    Adc_Init();
 
-    // System timer init (used in ST_RUN)
-    TIM4_DeInit();
-    TIM4_TimeBaseInit(TIM4_PRESCALER_16, 249);     // F = (Fmaster / Prescaler) / Period
-    TIM4_ITConfig(TIM4_IT_UPDATE, DISABLE);
+    // Control signal capture
+    initCapture((cfg.io.directControlActiveHigh) ? CapPosImpulse : CapNegImpulse);
+
+    // Half-duplex UART at GPD_UART_PIN
+    UART_Init();
     
     // Use Active-halt with main voltage regulator (MVR) powered off 
     // This option drops consumption down to 60uA instead of 200
@@ -394,7 +895,21 @@ int main()
     CLK_SlowActiveHaltWakeUpCmd(ENABLE);
     
     // Init FSM
-    swState(ST_WAKEUP);
+    // Alarm interrupted by reset is resumed at once, without wake-up checks and pre-alarm.
+    // Reset by debugger is not resumed.
+    if ((resetCause != ResetSwim) && isResumeValid() && !isMainSupplyPresent())
+    {
+        Nvm_LogEvent(NvmEvtResume, resume.state);
+        almStage = resume.almStage;
+        timers.alm = resume.timeMs;
+        swState((bState_t)resume.state);
+        if (state == ST_PREALARM)
+            timers.state = (uint16_t)resume.timeMs;
+    }
+    else
+    {
+        swState(ST_WAKEUP);
+    }
     
     // Start
     enableInterrupts();  
@@ -432,9 +947,15 @@ int main()
                     else
                     {
                         // Power glitch
+                        Nvm_LogEvent(NvmEvtSupplyLoss, 0);
                         swState(ST_PREALARM); 
                     }
                 }
+                else if ((Nvm_GetStatus() & NVM_STATUS_LOW_BATTERY) && (measureVbatMv() < UV_RELEASE_MV))
+                {
+                    // Battery has not recovered after over-discharge cutoff, keep it from draining
+                    swState(ST_SLEEP);
+                }
                 else
                 {
                     // Check BTN state
@@ -468,7 +989,7 @@ int main()
                         SET_LED(Led3, volumeLedIndication[buzzerVolume].led3);
                     }
 
-                    LP_WFI_SYSTMR(1);
+                    elapsedMs = LP_HALT_DEADLINE(limitSleepTime(VOLUME_SETUP_TIME - timers.state), 0);
 
                     if (isMainSupplyPresent())
                     {
@@ -481,18 +1002,15 @@ int main()
                     ProcessButtons();
 
                     // Process state timer
-                    timers.state++;
+                    timers.state += elapsedMs;
 
                     // If button has not been pressed for about 1 second and there is no supply, sleep again
-                    if (timers.state >= 100)
+                    if (timers.state >= VOLUME_SETUP_TIME)
                     {
                         // Beep at selected level
                         Buzz_PutTone(Tone1, 100);
-                        while (Buzz_IsActive())
-                        {
-                            LP_WFI_SYSTMR(1);
-                            Buzz_Process();
-                        }
+                        LP_PLAY_BUZZER();
+                        saveConfig();
                         swState(ST_SLEEP);
                         break;
                     }
@@ -507,23 +1025,45 @@ int main()
                 break;
 
             case ST_RUN:
-                // Using Tim4 as timebase source for better accuracy
-                stopAwu();
-                TIM4_Cmd(ENABLE);
-                TIM4_ITConfig(TIM4_IT_UPDATE, ENABLE);
+                // FSM is processed on external interrupts and alarm deadlines, CPU is in active halt meanwhile
+                startAwu(AWU_10MS);
                 reset_alarms();
                 SET_LED((buzzerVolume == VolumeSilent) ? Led1 : Led2, 1)
-                
+
+                // Detect control protocol at SIG: level, RC PWM or PPM
+                // Controller is supposed to be idle at power-up
+                startClassifier();
+                timers.cap = 0;
+                elapsedMs = 0;
+
+                // Look for CRSF stream at first opportunity
+                UART_ResetCrsf();
+                timers.crsf = CRSF_PROBE_PERIOD;
+                crsfListenMs = 0;
+                timers.adc = ADC_SCAN_PERIOD;       // Measure on first entry
+
+                // Battery may be charged or replaced, capacity is estimated again when main supply is lost
+                Gauge_Reset();
+                uvCount = 0;
+                Nvm_WriteByte(NVM_ADDR_BROWNOUTS, 0);
+                volumeBackoff = 0;
+                PWM_SetVolumeBackoff(0);
+
+                // Report over-discharge shutdown of the previous run
+                if (Nvm_GetStatus() & NVM_STATUS_LOW_BATTERY)
+                {
+                    Nvm_ClearStatus(NVM_STATUS_LOW_BATTERY);
+                    Buzz_PlayPattern(alarmBatteryCritical);
+                    LP_PLAY_BUZZER();
+                }
+
                 // TODO: Detect cell count for power battery
                 // TODO: Enable other peripherals
                 while (1)
                 {
-                    //SET_LED(Led1, 0);
-                    LP_WFI_SYSTMR(1);
-                    //SET_LED(Led1, 1);
-
                     if (!isMainSupplyPresent())
                     {
+                        Nvm_LogEvent(NvmEvtSupplyLoss, 0);
                         swState(ST_PREALARM);
                         break;
                     }
@@ -532,7 +1072,8 @@ int main()
                     ProcessButtons();
 
                     // Process buzzer controller once per 10ms
-                    if (++timers.tick >= 10)
+                    timers.tick += elapsedMs;
+                    if (timers.tick >= BUZZER_FSM_CALL_PERIOD_MS)
                     {
                         timers.tick = 0;
                         Buzz_Process();
@@ -545,24 +1086,48 @@ int main()
                         break;
                     }
 
+                    // Measure battery voltage
+                    processBattery(elapsedMs);
+
+                    // Telemetry, if enabled, is sent at wake-ups only
+                    Cmd_ProcessTelemetry(elapsedMs);
+
+                    // Background EEPROM write
+                    Nvm_Process();
+
+                    // Sample RC PWM or PPM signal periodically. Without signal capture is kept armed,
+                    // so SIG edge starts capture and wakes CPU to check direct control immediately.
+                    // Signal is classified again if it changes.
+                    timers.cap += elapsedMs;
+                    if ((timers.cap >= CAP_SAMPLE_PERIOD) || (getCapturedPulseUs() == 0))
+                    {
+                        armCapture(timers.cap);
+                        timers.cap = 0;
+                    }
+
+                    // Commands from flight controller
+                    Cmd_Process();
+
+                    // Probe UART for CRSF stream periodically
+                    if (timers.crsf < CRSF_PROBE_PERIOD)
+                        timers.crsf += elapsedMs;
+
                     // Process various alarms
-                    check_alarms();
+                    check_alarms(elapsedMs);
 
                     // Apply alarms depending on priority
-                    if (alarms.controlTimeout.isActive)
+                    // Beacon and link loss alarms use patterns, so DShot and CRSF are decoded between them
+                    if (alarms.controlTimeout.isActive || alarms.dshotBeacon.isActive || alarms.linkLoss.isActive)
                     {
-                        if (alarms.repeatTimer == 0)
+                        alarms.repeatTimer += elapsedMs;
+                        if (alarms.repeatTimer >= CTRL_ALM_REP_PERIOD)
                         {
                             // Emit alarm signal
-                            alarm3();
-                        }
-                        if (++alarms.repeatTimer >= CTRL_ALM_REP_PERIOD)
-                        {
-                            // Alarm will be fired on next entry
                             alarms.repeatTimer = 0;
+                            Buzz_PlayPattern(alarm3);
                         }
                     }
-                    else if (alarms.directControl.isActive)
+                    else if (alarms.directControl.isActive || alarms.pwmControl.isActive)
                     {
                         if (!Buzz_IsContinuousBeep())
                             Buzz_BeepContinuous(Tone1);
@@ -571,9 +1136,38 @@ int main()
                     {
                         Buzz_Stop();
                     }
+
+                    // Sleep until the nearest deadline: alarm, measurement or periodic check
+                    sleepMs = ADC_SCAN_PERIOD - timers.adc;
+                    if (sleepMs > RUN_CHECK_PERIOD)
+                        sleepMs = RUN_CHECK_PERIOD;
+                    if (sleepMs > get_alarms_deadline())
+                        sleepMs = (uint16_t)get_alarms_deadline();
+                    if (((getCapturedPulseUs() != 0) || !isCaptureArmed()) && (sleepMs > CAP_SAMPLE_PERIOD - timers.cap))
+                        sleepMs = CAP_SAMPLE_PERIOD - timers.cap;
+
+                    // SIG interrupt is enabled by armed capture only, to avoid wake-up at each edge
+                    if (!Buzz_IsHaltAllowed() && !Buzz_IsContinuousBeep())
+                        elapsedMs = LP_WFI_BUZZER();
+                    else if ((getCaptureProtocol() == CtrlProtoDshot) && Buzz_IsHaltAllowed() && !UART_IsBusy())
+                        elapsedMs = LP_DSHOT_DEADLINE(limitSleepTime(sleepMs));
+                    else if (Buzz_IsHaltAllowed() && !isCaptureActive() && !UART_IsBusy() &&
+                             (UART_IsCrsfPresent() || (timers.crsf >= CRSF_PROBE_PERIOD)))
+                    {
+                        if (!UART_IsCrsfPresent())
+                        {
+                            timers.crsf = 0;
+                            if (sleepMs > CRSF_PROBE_TIME)
+                                sleepMs = CRSF_PROBE_TIME;
+                        }
+                        elapsedMs = LP_CRSF_DEADLINE(limitSleepTime(sleepMs));
+                    }
+                    else
+                        elapsedMs = LP_HALT_DEADLINE(limitSleepTime(sleepMs), 1);
                 }
-                TIM4_Cmd(DISABLE);
-                TIM4_ITConfig(TIM4_IT_UPDATE, DISABLE);
+
+                // Disable interrupt from SIG and capture
+                stopCapture();
                 // TODO: Disable peripherals
                 break;
 
@@ -591,24 +1185,21 @@ int main()
                         SET_LED(Led3, volumeLedIndication[buzzerVolume].led3);
                     }
 
-                    LP_WFI_SYSTMR(1);
+                    elapsedMs = LP_HALT_DEADLINE(limitSleepTime(VOLUME_SETUP_TIME - timers.state), 0);
 
                     // Check BTN state
                     ProcessButtons();
 
                     // Process state timer
-                    timers.state++;
+                    timers.state += elapsedMs;
 
-                    // If button has not been pressed for about 1 second and there is no supply, sleep again
-                    if (timers.state >= 100)
+                    // If button has not been pressed for about 1 second, return to normal operation
+                    if (timers.state >= VOLUME_SETUP_TIME)
                     {
                         // Beep at selected level
                         Buzz_PutTone(Tone1, 100);
-                        while (Buzz_IsActive())
-                        {
-                            LP_WFI_SYSTMR(1);
-                            Buzz_Process();
-                        }
+                        LP_PLAY_BUZZER();
+                        saveConfig();
                         swState(ST_RUN);
                         LP_WFI_SYSTMR(10);
                         break;
@@ -625,15 +1216,21 @@ int main()
 
             case ST_PREALARM:
                 startAwu(AWU_10MS);
+                supplyLossMs = SysTime_GetMs();
                 while(1)
                 {
-                    if (Buzz_IsActive())
-                        LP_WFI_SYSTMR(1);
+                    // Sleep until the nearest deadline: pre-alarm end or next beep
+                    sleepMs = PREALM_TIME - timers.state;
+                    if (sleepMs > PREALM_BEEP_PERIOD - timers.dly)
+                        sleepMs = PREALM_BEEP_PERIOD - timers.dly;
+                    if (!Buzz_IsHaltAllowed())
+                        elapsedMs = LP_WFI_BUZZER();
                     else
-                        LP_HALT_SYSTMR(1);
+                        elapsedMs = LP_HALT_DEADLINE(limitSleepTime(sleepMs), 0);
 
                     if (isMainSupplyPresent())
                     {
+                        Nvm_LogEvent(NvmEvtSupplyRestored, ST_PREALARM);
                         swState(ST_WAKEUP);
                         break;
                     }
@@ -644,22 +1241,44 @@ int main()
                     // Process buzzer controller
                     Buzz_Process();
 
+                    // Measure battery voltage
+                    processBattery(elapsedMs);
+
+                    // Telemetry, if enabled, is sent at wake-ups only
+                    Cmd_ProcessTelemetry(elapsedMs);
+
+                    // Background EEPROM write
+                    Nvm_Process();
+                    if (isBatteryCritical())
+                    {
+                        swState(ST_LOW_BATTERY);
+                        break;
+                    }
+
                     if (buttons.action_down & BTN)
                     {
                         // User wants to disable buzzer
+                        Nvm_LogEvent(NvmEvtSilenced, ST_PREALARM);
                         swState(ST_SLEEP);
                         break;
                     }
 
-                    if (++timers.state >= (PREALM_TIME / 10))
+                    timers.state += elapsedMs;
+                    if (timers.state >= PREALM_TIME)
                     {
+                        Nvm_LogEvent(NvmEvtAlarmStart, 0);
+                        almStage = 0;
+                        timers.alm = 0;
                         swState(ST_ALARM);
                         break;
                     }
                     else
                     {
+                        saveResume(ST_PREALARM, 0, timers.state);
+
                         // Beep once per second indicating pre-alarm state
-                        if (++timers.dly >= 100)
+                        timers.dly += elapsedMs;
+                        if (timers.dly >= PREALM_BEEP_PERIOD)
                         {
                             Buzz_PutTone(Tone1, 10);
                             timers.dly = 0;
@@ -670,18 +1289,23 @@ int main()
 
             case ST_ALARM:
                 startAwu(AWU_10MS);
-                almPeriod = ALM_PERIOD / 10;
+                // Stage and alarm time are set by pre-alarm or by resume after reset
+                almStage = get_alarm_stage(almStage);
+                timers.dly = ALM_PERIOD_MS(almStage);           // Emit alarm signal on first entry
                 while(1)
                 {
-                    if (Buzz_IsActive())
-                        LP_WFI_SYSTMR(1);
+                    // Sleep until next alarm signal
+                    sleepMs = (timers.dly < ALM_PERIOD_MS(almStage)) ? ALM_PERIOD_MS(almStage) - timers.dly : 0;
+                    if (!Buzz_IsHaltAllowed())
+                        elapsedMs = LP_WFI_BUZZER();
                     else
-                        LP_HALT_SYSTMR(1);
+                        elapsedMs = LP_HALT_DEADLINE(limitSleepTime(sleepMs), 0);
 
-                    // Alarm is emitted until battery is drained, button is pressed or
+                    // Alarm is emitted until battery is drained down to cutoff voltage, button is pressed or
                     // main supply voltage is reapplied
                     if (isMainSupplyPresent())
                     {
+                        Nvm_LogEvent(NvmEvtSupplyRestored, ST_ALARM);
                         swState(ST_WAKEUP);
                         break;
                     }
@@ -692,36 +1316,63 @@ int main()
                     // Process buzzer controller
                     Buzz_Process();
 
+                    // Measure battery voltage
+                    processBattery(elapsedMs);
+
+                    // Telemetry, if enabled, is sent at wake-ups only
+                    Cmd_ProcessTelemetry(elapsedMs);
+
+                    // Background EEPROM write
+                    Nvm_Process();
+                    if (isBatteryCritical())
+                    {
+                        swState(ST_LOW_BATTERY);
+                        break;
+                    }
+
                     if (buttons.action_down & BTN)
                     {
                         // User wants to disable buzzer
+                        Nvm_LogEvent(NvmEvtSilenced, ST_ALARM);
                         swState(ST_SLEEP);
                         break;
                     }
 
-                    // Emit alarm signal on first entry and every time timer is done
-                    if (timers.dly == 0)
-                    {
-                        alarm3();
-                    }
-                    if (++timers.dly >= almPeriod)
-                    {
-                        timers.dly = 0;
-                    }
+                    // Reduce alarms with time and battery discharge
+                    timers.alm += elapsedMs;
+                    almStage = get_alarm_stage(almStage);
+                    saveResume(ST_ALARM, almStage, timers.alm);
 
-                    // After some time, reduce frequency of alarms to save battery
-                    if (timers.alm < (ALM_2ND_STAGE_TIME / 10))
+                    // Emit alarm signal every time timer is done
+                    timers.dly += elapsedMs;
+                    if (timers.dly >= ALM_PERIOD_MS(almStage))
                     {
-                        timers.alm++;
-                    }
-                    else
-                    {
-                        almPeriod = (ALM_2ND_STAGE_PERIOD / 10);
+                        timers.dly = 0;
+                        // Measure battery without load
+                        Adc_WaitScanDone();
+                        Buzz_PlayPattern(almSchedule[almStage].pattern);
                     }
                 }
                 break;
 
+            case ST_LOW_BATTERY:
+                // Save the cell: latch the event, play final signal and shut down
+                // until main supply is applied or battery recovers
+                Nvm_SetStatus(NVM_STATUS_LOW_BATTERY);
+                Nvm_LogEvent(NvmEvtBatteryCutoff, almStage);
+                startAwu(AWU_10MS);
+                Buzz_PlayPattern(alarmBatteryCritical);
+                LP_PLAY_BUZZER();
+                swState(ST_SLEEP);
+                break;
+
             case ST_SLEEP:
+                // ADC and VREF supply must be powered down
+                Adc_WaitScanDone();
+
+                // Settings must be written before halt
+                Nvm_Flush();
+
                 // Enable interrupt from main supply IRQ and BTN
                 GPIO_Init(GPIOB, GPB_BTN_PIN, GPIO_MODE_IN_FL_IT);
                 GPIO_Init(GPIOB, GPB_VCCSEN_PIN, GPIO_MODE_IN_FL_IT);
@@ -753,44 +1404,112 @@ void onBuzzerStateChanged(uint8_t isActive)
 }
 
 
+// Callbacks from command protocol, commands are processed in ST_RUN only
+void onCmdSetVolume(eVolume volume)
+{
+    buzzerVolume = volume;
+    Buzz_SetVolume(volume);
+    SET_LED(Led1, (buzzerVolume == VolumeSilent));
+    SET_LED(Led2, (buzzerVolume != VolumeSilent));
+    saveConfig();
+}
 
 
-//=================================================================//
-// Interrupt handlers
+void onCmdGetConfig(config_t *config)
+{
+    cfg.volume = buzzerVolume;
+    *config = cfg;
+}
 
 
-INTERRUPT_HANDLER(IRQ_Handler_TIM4, 23)
+uint8_t onCmdSetConfig(const config_t *config)
 {
-    // Clear the IT pending Bit
-    TIM4->SR1 = (uint8_t)(~TIM4_IT_UPDATE);
-    // Set global flag. Interrupt handler is used to run main loop.
-    sysFlag_TmrTick = 1;
+    if (!isConfigValid(config))
+        return 0;
+    cfg = *config;
+    onCmdSetVolume((eVolume)cfg.volume);
+    return 1;
 }
 
 
-INTERRUPT_HANDLER(IRQ_Handler_AWU, 1)
+void onCmdTimeoutAlarm(uint8_t isArmed)
 {
-    volatile unsigned char reg;
-    // Reading AWU_CSR register clears the interrupt flag.
-    reg = AWU->CSR;
-    // Set global flag. Interrupt handler is used to run main loop.
-    sysFlag_TmrTick = 1;
+    alarms.controlTimeout.isDisarmed = !isArmed;
 }
 
 
-INTERRUPT_HANDLER(IRQ_Handler_GPIOB, 4)
+// Active alarms as CMD_ALARM_xxx flags
+uint8_t getAlarmFlags(void)
 {
-    // Do nothing. Interrupt handler is used to run main loop.
+    uint8_t flags = 0;
+
+    if (alarms.directControl.isActive)
+        flags |= CMD_ALARM_DIRECT_CONTROL;
+    if (alarms.pwmControl.isActive)
+        flags |= CMD_ALARM_PWM_CONTROL;
+    if (alarms.controlTimeout.isActive)
+        flags |= CMD_ALARM_CONTROL_TIMEOUT;
+    if (alarms.dshotBeacon.isActive)
+        flags |= CMD_ALARM_DSHOT_BEACON;
+    if (alarms.linkLoss.isActive)
+        flags |= CMD_ALARM_LINK_LOSS;
+    if (alarms.controlTimeout.isDisarmed)
+        flags |= CMD_ALARM_TIMEOUT_DISARMED;
+    return flags;
 }
 
 
-// INTERRUPT_HANDLER(IRQ_Handler_GPIOC, 5)
-// {
-//     if (isDirectControlInputActive())
-//     {
+void onCmdGetStatus(cmdStatus_t *status)
+{
+    adcResult_t adc;
+
+    Adc_GetResult(&adc);
+    status->state = (uint8_t)state;
+    status->volume = buzzerVolume;
+    status->alarms = getAlarmFlags();
+    status->vbatMv = adc.vbatMv;
+}
+
 
-//     }
-// }
+void onCmdGetTelemetry(cmdTelemetry_t *telemetry)
+{
+    adcResult_t adc;
+
+    Adc_GetResult(&adc);
+    telemetry->state = (uint8_t)state;
+    telemetry->alarms = (state == ST_RUN) ? getAlarmFlags() : 0;
+    telemetry->vbatMv = adc.vbatMv;
+    telemetry->uptimeMs = SysTime_GetMs();
+    telemetry->supplyLossMs = ((state == ST_PREALARM) || (state == ST_ALARM)) ?
+                              telemetry->uptimeMs - supplyLossMs : 0;
+    telemetry->resetCause = (uint8_t)resetCause;
+    telemetry->volumeBackoff = volumeBackoff;
+    // Estimate is made while powered from battery
+    telemetry->socPercent = (Gauge_IsValid()) ? Gauge_GetSocPercent() : 0xFF;
+    telemetry->lifetimeMin = (Gauge_IsValid()) ? Gauge_GetLifetimeMin() : 0;
+}
+
+
+
+
+//=================================================================//
+// Interrupt handlers
+
+
+INTERRUPT_HANDLER(IRQ_Handler_GPIOB, 4)
+{
+    // Interrupt handler is used to run main loop.
+    sysFlag_ExtIrq = 1;
+}
+
+
+INTERRUPT_HANDLER(IRQ_Handler_GPIOC, 5)
+{
+    // SIG edge starts armed capture as early as possible
+    triggerCapture();
+    // Interrupt handler is used to run main loop.
+    sysFlag_ExtIrq = 1;
+}
 
 
 
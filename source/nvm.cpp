@@ -0,0 +1,346 @@
+/**
+    @brief Data EEPROM access
+    @author avegawanderer
+*/
+
+#include "global_def.h"
+#include "nvm.h"
+#include "uart.h"
+#include "systime.h"
+
+
+/*
+    EEPROM is written byte by byte, write takes about 6ms.
+    Bytes are written only if value is changed to save EEPROM endurance (100k cycles).
+
+    Configuration is stored as versioned record with sequence number and CRC8 (same as UART frames).
+    Records rotate over NVM_CONFIG_SLOTS, so each slot is written once per NVM_CONFIG_SLOTS saves,
+    and the previous record stays valid if write is interrupted by power loss.
+    Record is written in background: Nvm_Process() starts next byte when the previous one is done,
+    as reported by FLASH_IAPSR. CPU must not enter halt meanwhile, see Nvm_IsBusy().
+
+    Event log is a ring of 4-byte records, each record is written by single word programming.
+    Events are queued in RAM and written in background before pending config bytes.
+    Bit NVM_LOG_PHASE of record is flipped at each pass over the ring, so the next record
+    to be written is the first one with phase different from the first record, or empty one.
+*/
+
+#define NVM_LOG_RECORDS             (NVM_LOG_AREA_SIZE / sizeof(nvmLogRecord_t))
+#define NVM_LOG_QUEUE_SIZE          4           // Power of 2
+#define NVM_LOG_PHASE               0x80
+#define NVM_LOG_EVENT_MASK          0x7F
+
+// Config record
+typedef struct {
+    uint8_t version;
+    uint8_t sequence;               // Incremented by each save, the newest valid record is used
+    config_t config;
+    uint8_t crc;                    // CRC8 of the bytes above
+} nvmConfigRecord_t;
+
+#define NVM_CONFIG_SLOT_SIZE        sizeof(nvmConfigRecord_t)
+#define NVM_CONFIG_SLOTS            (NVM_CONFIG_AREA_SIZE / NVM_CONFIG_SLOT_SIZE)
+
+// EEPROM is memory-mapped
+#define NVM_CONFIG_RECORD(slot)     ((const nvmConfigRecord_t *)(uint16_t)(FLASH_DATA_START_PHYSICAL_ADDRESS + \
+                                        NVM_ADDR_CONFIG + (slot) * NVM_CONFIG_SLOT_SIZE))
+
+
+#define NVM_LOG_RECORD(index)       ((const nvmLogRecord_t *)(uint16_t)(FLASH_DATA_START_PHYSICAL_ADDRESS + \
+                                        NVM_ADDR_LOG + (index) * sizeof(nvmLogRecord_t)))
+
+
+static struct {
+    nvmConfigRecord_t record;       // The last saved or loaded record
+    uint8_t slot;                   // Slot of the last record
+    uint8_t isWriting;              // Config record is being written
+    uint8_t isProgramming;          // Byte or word programming is in progress
+    uint8_t index;                  // Byte of record being written
+    nvmLogRecord_t logQueue[NVM_LOG_QUEUE_SIZE];
+    uint8_t logHead;
+    uint8_t logTail;
+    uint8_t logIndex;               // Next record in EEPROM
+    uint8_t logPhase;
+} nvm;
+
+
+
+static uint8_t getRecordCrc(const nvmConfigRecord_t *record)
+{
+    const uint8_t *data = (const uint8_t *)record;
+    uint8_t crc = 0;
+    uint8_t i;
+
+    for (i = 0; i < NVM_CONFIG_SLOT_SIZE - 1; i++)
+        crc = UART_Crc8(crc, data[i]);
+    return crc;
+}
+
+
+/**
+    Find position of event log
+
+    Must be called once at startup
+*/
+void Nvm_Init(void)
+{
+    uint8_t phase = NVM_LOG_RECORD(0)->event & NVM_LOG_PHASE;
+    uint8_t i;
+
+    for (i = 0; i < NVM_LOG_RECORDS; i++)
+    {
+        if (((NVM_LOG_RECORD(i)->event & NVM_LOG_EVENT_MASK) == NvmEvtNone) ||
+            ((NVM_LOG_RECORD(i)->event & NVM_LOG_PHASE) != phase))
+            break;
+    }
+    if (i == 0)
+    {
+        nvm.logPhase = NVM_LOG_PHASE;       // Empty log
+    }
+    else if (i == NVM_LOG_RECORDS)
+    {
+        i = 0;                              // Full pass is done
+        nvm.logPhase = phase ^ NVM_LOG_PHASE;
+    }
+    else
+    {
+        nvm.logPhase = phase;
+    }
+    nvm.logIndex = i;
+}
+
+
+uint8_t Nvm_ReadByte(uint8_t addr)
+{
+    return FLASH_ReadByte(FLASH_DATA_START_PHYSICAL_ADDRESS + addr);
+}
+
+
+/**
+    Write byte to EEPROM
+
+    Blocks until write is done, background write of config record is finished before
+*/
+void Nvm_WriteByte(uint8_t addr, uint8_t value)
+{
+    Nvm_Flush();
+    if (Nvm_ReadByte(addr) == value)
+        return;
+    FLASH_Unlock(FLASH_MEMTYPE_DATA);
+    FLASH_ProgramByte(FLASH_DATA_START_PHYSICAL_ADDRESS + addr, value);
+    FLASH_WaitForLastOperation(FLASH_MEMTYPE_DATA);
+    FLASH_Lock(FLASH_MEMTYPE_DATA);
+}
+
+
+uint8_t Nvm_GetStatus(void)
+{
+    return Nvm_ReadByte(NVM_ADDR_STATUS);
+}
+
+
+void Nvm_SetStatus(uint8_t flags)
+{
+    Nvm_WriteByte(NVM_ADDR_STATUS, Nvm_GetStatus() | flags);
+}
+
+
+void Nvm_ClearStatus(uint8_t flags)
+{
+    Nvm_WriteByte(NVM_ADDR_STATUS, Nvm_GetStatus() & (uint8_t)(~flags));
+}
+
+
+/**
+    Increment counter byte, saturated at 255
+
+    @return New value
+*/
+uint8_t Nvm_IncrementCounter(uint8_t addr)
+{
+    uint8_t value = Nvm_ReadByte(addr);
+
+    if (value != 0xFF)
+        Nvm_WriteByte(addr, ++value);
+    return value;
+}
+
+
+/**
+    Load configuration
+
+    @param config Configuration from the newest valid record, not changed if there is none
+    @return 1 if valid record is found
+*/
+uint8_t Nvm_LoadConfig(config_t *config)
+{
+    const nvmConfigRecord_t *record;
+    uint8_t isFound = 0;
+    uint8_t slot;
+
+    for (slot = 0; slot < NVM_CONFIG_SLOTS; slot++)
+    {
+        record = NVM_CONFIG_RECORD(slot);
+        if ((record->version != NVM_CONFIG_VERSION) || (record->crc != getRecordCrc(record)))
+            continue;
+        if (!isFound || ((int8_t)(record->sequence - nvm.record.sequence) > 0))
+        {
+            nvm.record = *record;
+            nvm.slot = slot;
+            isFound = 1;
+        }
+    }
+    if (isFound)
+        *config = nvm.record.config;
+    else
+        nvm.slot = NVM_CONFIG_SLOTS - 1;        // The first save goes to slot 0
+    return isFound;
+}
+
+
+/**
+    Save configuration
+
+    Record is written to the next slot in background by Nvm_Process(), if configuration is changed.
+    Save requested while writing restarts the write with new data.
+    @param config Configuration to save
+*/
+void Nvm_SaveConfig(const config_t *config)
+{
+    const uint8_t *src = (const uint8_t *)config;
+    uint8_t *dst = (uint8_t *)&nvm.record.config;
+    uint8_t isChanged = 0;
+    uint8_t i;
+
+    for (i = 0; i < sizeof(config_t); i++)
+    {
+        if (dst[i] != src[i])
+            isChanged = 1;
+        dst[i] = src[i];
+    }
+    if (!isChanged && (nvm.record.version == NVM_CONFIG_VERSION))
+        return;
+
+    if (!nvm.isWriting)
+    {
+        nvm.slot = (nvm.slot + 1 < NVM_CONFIG_SLOTS) ? nvm.slot + 1 : 0;
+        nvm.record.sequence++;
+        nvm.isWriting = 1;
+    }
+    nvm.record.version = NVM_CONFIG_VERSION;
+    nvm.record.crc = getRecordCrc(&nvm.record);
+    nvm.index = 0;
+}
+
+
+/**
+    Put event into log
+
+    Record is written in background by Nvm_Process(), event is dropped if queue is full
+    @param event eNvmEvent
+    @param arg Event argument
+*/
+void Nvm_LogEvent(eNvmEvent event, uint8_t arg)
+{
+    nvmLogRecord_t *record = &nvm.logQueue[nvm.logHead];
+    uint32_t time = SysTime_GetMs() / NVM_LOG_TIME_UNIT_MS;
+    uint8_t head = (nvm.logHead + 1) & (NVM_LOG_QUEUE_SIZE - 1);
+
+    if (head == nvm.logTail)
+        return;
+    record->event = (uint8_t)event;
+    record->arg = arg;
+    record->time = (time < 0xFFFF) ? (uint16_t)time : 0xFFFF;
+    nvm.logHead = head;
+}
+
+
+// Write queued event as single word
+static void writeLogRecord(void)
+{
+    const uint8_t *data = (const uint8_t *)&nvm.logQueue[nvm.logTail];
+    PointerAttr uint8_t *dst = (PointerAttr uint8_t *)(uint16_t)(FLASH_DATA_START_PHYSICAL_ADDRESS +
+                                NVM_ADDR_LOG + nvm.logIndex * sizeof(nvmLogRecord_t));
+
+    nvm.logQueue[nvm.logTail].event |= nvm.logPhase;
+    FLASH->CR2 |= FLASH_CR2_WPRG;
+    FLASH->NCR2 &= (uint8_t)(~FLASH_NCR2_NWPRG);
+    dst[0] = data[0];
+    dst[1] = data[1];
+    dst[2] = data[2];
+    dst[3] = data[3];
+    nvm.isProgramming = 1;
+
+    nvm.logTail = (nvm.logTail + 1) & (NVM_LOG_QUEUE_SIZE - 1);
+    if (++nvm.logIndex == NVM_LOG_RECORDS)
+    {
+        nvm.logIndex = 0;
+        nvm.logPhase ^= NVM_LOG_PHASE;
+    }
+}
+
+
+// Write next changed byte of config record
+static void writeConfigByte(void)
+{
+    const uint8_t *data = (const uint8_t *)&nvm.record;
+    uint8_t addr = NVM_ADDR_CONFIG + nvm.slot * NVM_CONFIG_SLOT_SIZE;
+
+    while ((nvm.index < NVM_CONFIG_SLOT_SIZE) && (Nvm_ReadByte(addr + nvm.index) == data[nvm.index]))
+        nvm.index++;
+    if (nvm.index == NVM_CONFIG_SLOT_SIZE)
+    {
+        nvm.isWriting = 0;
+        return;
+    }
+    FLASH_ProgramByte(FLASH_DATA_START_PHYSICAL_ADDRESS + addr + nvm.index, data[nvm.index]);
+    nvm.isProgramming = 1;
+}
+
+
+/**
+    Continue background write
+
+    Must be called from main loop while Nvm_IsBusy() is set
+*/
+void Nvm_Process(void)
+{
+    if (!Nvm_IsBusy())
+        return;
+    if (nvm.isProgramming)
+    {
+        // Reading IAPSR clears EOP
+        if (!(FLASH->IAPSR & (FLASH_IAPSR_EOP | FLASH_IAPSR_WR_PG_DIS)))
+            return;
+        nvm.isProgramming = 0;
+    }
+
+    if (!(FLASH->IAPSR & FLASH_IAPSR_DUL))
+        FLASH_Unlock(FLASH_MEMTYPE_DATA);
+    if (nvm.logTail != nvm.logHead)
+        writeLogRecord();
+    else if (nvm.isWriting)
+        writeConfigByte();
+
+    // Lock EEPROM when everything is written
+    if (!nvm.isProgramming)
+        FLASH_Lock(FLASH_MEMTYPE_DATA);
+}
+
+
+uint8_t Nvm_IsBusy(void)
+{
+    return nvm.isWriting || nvm.isProgramming || (nvm.logTail != nvm.logHead);
+}
+
+
+/**
+    Finish background write
+
+    Blocks until write is done
+*/
+void Nvm_Flush(void)
+{
+    while (Nvm_IsBusy())
+        Nvm_Process();
+}
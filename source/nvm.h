@@ -0,0 +1,81 @@
+#ifndef __NVM_H__
+#define __NVM_H__
+
+#include "global_def.h"
+
+
+/*
+    Data EEPROM map (128 bytes)
+    0x00 - 0x1F     Config records, see nvm.cpp
+    0x20            Status flags, NVM_STATUS_xxx
+    0x21 - 0x27     Reset counters, one per eResetCause, saturated at 255
+    0x28            Brownout resets since main supply loss, saturated at 255
+    0x40 - 0x7F     Event log
+*/
+#define NVM_SIZE                    128
+#define NVM_ADDR_CONFIG             0x00
+#define NVM_CONFIG_AREA_SIZE        0x20
+#define NVM_ADDR_STATUS             0x20
+#define NVM_ADDR_RESET_COUNTERS     0x21
+#define NVM_ADDR_BROWNOUTS          0x28
+#define NVM_ADDR_LOG                0x40
+#define NVM_LOG_AREA_SIZE           0x40
+
+// Timestamp unit of event log, uptime is not counted in ST_SLEEP
+#define NVM_LOG_TIME_UNIT_MS        4000
+
+// Must be changed with layout of config_t
+#define NVM_CONFIG_VERSION          1
+
+// Status flags
+#define NVM_STATUS_LOW_BATTERY      0x01        // Shut down due to battery over-discharge
+
+// Reset causes
+typedef enum {
+    ResetPowerOn,
+    ResetBrownout,              // Inferred: reset without RST_SR flags while H-bridge was driven
+    ResetIwdg,
+    ResetWwdg,
+    ResetIllegalOpcode,
+    ResetSwim,
+    ResetEmc,
+    ResetCauseCount
+} eResetCause;
+
+// Logged events
+typedef enum {
+    NvmEvtNone,                 // Empty record
+    NvmEvtReset,                // Arg: eResetCause
+    NvmEvtSupplyLoss,
+    NvmEvtSupplyRestored,       // Arg: bState_t
+    NvmEvtAlarmStart,
+    NvmEvtSilenced,             // By button, arg: bState_t
+    NvmEvtBatteryCutoff,        // Arg: alarm schedule stage
+    NvmEvtResume,               // Alarm resumed after reset, arg: bState_t
+} eNvmEvent;
+
+// Event log record, event is ORed with pass phase bit 7
+typedef struct {
+    uint8_t event;
+    uint8_t arg;
+    uint16_t time;              // Uptime [NVM_LOG_TIME_UNIT_MS], saturated
+} nvmLogRecord_t;
+
+
+void Nvm_Init(void);
+uint8_t Nvm_ReadByte(uint8_t addr);
+void Nvm_WriteByte(uint8_t addr, uint8_t value);
+uint8_t Nvm_GetStatus(void);
+void Nvm_SetStatus(uint8_t flags);
+void Nvm_ClearStatus(uint8_t flags);
+uint8_t Nvm_IncrementCounter(uint8_t addr);
+uint8_t Nvm_LoadConfig(config_t *config);
+void Nvm_SaveConfig(const config_t *config);
+void Nvm_LogEvent(eNvmEvent event, uint8_t arg);
+void Nvm_Process(void);
+uint8_t Nvm_IsBusy(void);
+void Nvm_Flush(void);
+
+
+
+#endif  // __NVM_H__
@@ -13,6 +13,27 @@
 
 #define TIM1_CAPWM_FMASTER_DIV          2       // TIM1 clk must be 2MHz, select accordingly to Fmaster
 
+/*
+    Timed tones
+    In center-aligned mode update event (UEV) is generated at both overflow and underflow,
+    so there are (2000 / pwm_period) UEVs per ms.
+    Repetition counter is used to generate update interrupt once per up to 256 UEVs,
+    note end is reported by onPwmNoteDone() callback from TIM1 update ISR.
+*/
+#define TIM1_MAX_REP_BLOCK              256
+
+// Number of LSI captures (each is 8 LSI periods) used for LSI frequency measurement
+#define LSI_MEAS_CAPTURES               16
+
+/*
+    Brownout detection
+    Peak H-bridge current may pull battery voltage below reset threshold. RST_SR has no brownout flag,
+    so a marker is kept in no-init RAM while bridge is driven: it survives brownout reset,
+    but power-on reset leaves random value there.
+    Volume back-off then selects dead-time of lower volume levels for all tones.
+*/
+#define BRIDGE_ACTIVE_MARK              0xB5A3
+
 /*
 DTG[7:5]            DT
     0xx (0x00)            DTG[6:0]  * (1*t)     0 to 127, step 1
@@ -37,37 +58,143 @@ DTG[7:5]            DT
 // To specify dead-time in us, use the macro below:
 #define DT2(x)      DT(2*(x))
 
+// Outputs are kept idle
+#define DT_IDLE(x)  0xFF
+
+
+/*
+    Supply voltage compensation
+    Current through the bridge grows with supply voltage, so dead-time is selected by VBAT bucket.
+    Reference dead-times are set for VBAT_NOMINAL_MV, for other buckets they are scaled
+    so that pulse width (period - dead-time) is inversely proportional to voltage:
+        dt = period - (period - dt_nominal) * VBAT_NOMINAL_MV / mv
+    This is linear approximation, measured current grows slightly faster at 5V.
+    Result must not be negative, which holds for dt_nominal >= 0.22 * period.
+*/
+#define VBAT_NOMINAL_MV     4200
+
+#define DT_VBAT(dt, period, mv)     ((period) - ((((uint32_t)(period) - (dt)) * VBAT_NOMINAL_MV) / (mv)))
+
+// VBAT buckets
+typedef enum {
+    VbatLow,
+    VbatMid,
+    VbatNominal,
+    VbatHigh,
+    VbatCount
+} eVbatBucket;
+
+// Lowest voltage of each bucket [mV]
+static const uint16_t vbatBucketMinMv[VbatCount] = {0, 3500, 3900, 4400};
+
+// Dead-time for each volume level at specified voltage
+// dtm is DT or DT2 depending on units used for the tone, period must be given in the same units:
+// pwm_period for DT2, 2 * pwm_period for DT
+#define DT_ROW(dtm, period, low, med, high, mv)  \
+    { 0xFF, dtm(DT_VBAT(low, period, mv)), dtm(DT_VBAT(med, period, mv)), dtm(DT_VBAT(high, period, mv)) }
 
-// Timer setup for a tone, including frequecy (period) and dead-time for valirous volume levels
+// Dead-time table for all VBAT buckets, compensation voltage is in the middle of bucket
+#define DT_TABLE(dtm, period, low, med, high) { \
+    DT_ROW(dtm, period, low, med, high, 3300), \
+    DT_ROW(dtm, period, low, med, high, 3700), \
+    DT_ROW(dtm, period, low, med, high, VBAT_NOMINAL_MV), \
+    DT_ROW(dtm, period, low, med, high, 5000) }
+
+
+// Timer setup for a tone, including frequecy (period) and dead-time for valirous volume levels and VBAT
 typedef struct {
     uint16_t pwm_period;
-    uint8_t pwm_dt[VolumeCount];
+    uint8_t pwm_dt[VbatCount][VolumeCount];
 } timCtrl_t;
 
 
+static struct {
+    volatile uint16_t uevLeft;      // UEVs left after block that is being counted by repetition counter
+} note;
+
+static eVbatBucket vbatBucket = VbatNominal;
+static uint8_t volumeBackoff;
+static __no_init volatile uint16_t bridgeActive;
+
+
+// Callback for timed tone end, called from ISR
+void onPwmNoteDone(void);
+
+
+#if ENA_BEEP_OUTPUT == 1
+// BEEP peripheral frequencies for low-power tones
+// Tone1 and Tone2 are both close to 2kHz, Tone3 is moved to 1kHz to keep it distinguishable
+static const uint8_t beepFreq[ToneCount] =
+{
+    0,                      // ToneSilence
+    BEEP_FREQUENCY_2KHZ,    // Tone1
+    BEEP_FREQUENCY_2KHZ,    // Tone2
+    BEEP_FREQUENCY_1KHZ,    // Tone3
+    BEEP_FREQUENCY_4KHZ     // Tone4
+};
+#endif
+
+
 // pwm_period = [us]
 // pwm_dt = [us], 0 to 504
-static timCtrl_t toneCtrl[ToneCount] =
-{
-    // PWM Period (must be even)        VolumeSilent    VolumeLow       VolumeMedium    VolumeHigh
-    {.pwm_period = 100,     .pwm_dt = { 0xFF,           0xFF,           0xFF,           0xFF       } },        // ToneSilence
-    {.pwm_period = 366,     .pwm_dt = { 0xFF,           DT2(356),       DT2(320),       DT2(180)   } },        // Tone1 - 2732Hz, 52mA @5V, 40mA @4.2V, 31 mA @3.3V
-    {.pwm_period = 416,     .pwm_dt = { 0xFF,           DT2(400),       DT2(380),       DT2(250)   } },        // Tone2 - 2403Hz, 40mA @5V, 33mA @4.2V
-    {.pwm_period = 480,     .pwm_dt = { 0xFF,           DT2(420),       DT2(390),       DT2(260)   } },        // Tone3 - 2083Hz, 46mA @5V, 38mA @4.2V
-    {.pwm_period = 183,     .pwm_dt = { 0xFF,           DT(178),        DT(160),        DT(90)     } }         // Tone4 - 5464Hz, 50mA @5V
+// Dead-times are specified for VBAT_NOMINAL_MV, currents are measured with uncompensated dead-time
+// Period column is used for compensation and is in dead-time units, see DT_ROW
+static const timCtrl_t toneCtrl[ToneCount] =
+{
+    // PWM Period (must be even)                    Period  VolumeLow   VolumeMedium    VolumeHigh
+    {.pwm_period = 100,     .pwm_dt = DT_TABLE(DT_IDLE, 100,    0,          0,              0          ) },      // ToneSilence
+    {.pwm_period = 366,     .pwm_dt = DT_TABLE(DT2,     366,    356,        320,            180        ) },      // Tone1 - 2732Hz, 52mA @5V, 40mA @4.2V, 31 mA @3.3V
+    {.pwm_period = 416,     .pwm_dt = DT_TABLE(DT2,     416,    400,        380,            250        ) },      // Tone2 - 2403Hz, 40mA @5V, 33mA @4.2V
+    {.pwm_period = 480,     .pwm_dt = DT_TABLE(DT2,     480,    420,        390,            260        ) },      // Tone3 - 2083Hz, 46mA @5V, 38mA @4.2V
+    {.pwm_period = 183,     .pwm_dt = DT_TABLE(DT,      366,    178,        160,            90         ) }       // Tone4 - 5464Hz, 50mA @5V
 };
 
 
+// Supply current for tones [mA], used for battery charge counting
+// Current is kept constant over VBAT by dead-time compensation, so values at 4.2V are used.
+// Only VolumeHigh is measured, other levels are scaled by pulse width (period - dead-time).
+static const uint8_t toneCurrentMa[ToneCount][VolumeCount] =
+{
+    // VolumeSilent     VolumeLow       VolumeMedium    VolumeHigh
+    {  0,               0,              0,              0         },        // ToneSilence
+    {  0,               2,              10,             40        },        // Tone1
+    {  0,               3,              7,              33        },        // Tone2
+    {  0,               10,             16,             38        },        // Tone3
+    {  0,               29,             31,             42        }         // Tone4, estimated from 5V
+};
 
-void PWM_Beep(eTone tone, eVolume volume)
+
+
+// Volume level used for dead-time, reduced by back-off down to VolumeLow
+static eVolume getEffectiveVolume(eVolume volume)
+{
+    if (volume <= VolumeLow)
+        return volume;
+    return (volume - VolumeLow > volumeBackoff) ? (eVolume)(volume - volumeBackoff) : VolumeLow;
+}
+
+
+static uint8_t getRepBlock(uint16_t uevCount)
 {
-    timCtrl_t *pTone = &toneCtrl[tone];
+    return (uint8_t)(((uevCount > TIM1_MAX_REP_BLOCK) ? TIM1_MAX_REP_BLOCK : uevCount) - 1);
+}
+
+
+/**
+    Setup and start TIM1 for a tone
+
+    @param uevCount Number of update events to count, 0 for continuous tone
+*/
+static void startTone(eTone tone, eVolume volume, uint16_t uevCount)
+{
+    const timCtrl_t *pTone = &toneCtrl[tone];
     uint16_t halfPeriod = pTone->pwm_period >> 1;
 
     // Select the Counter Mode
     TIM1->CR1 = 0;      // Timer disabled
     TIM1->CR2 = 0;      // CCx registers are not preloaded
     TIM1->BKR = 0;      // Outputs disabled
+    TIM1->IER = 0;      // Interrupts disabled
 
     // Set the Prescaler value
     TIM1->PSCRH = (uint8_t)0;
@@ -112,25 +239,237 @@ void PWM_Beep(eTone tone, eVolume volume)
     TIM1->CNTRH = 0;
     TIM1->CNTRL = 0;
 
+    // Load first block of note length into repetition counter, prescaler is loaded as well
+    // Software UG does not generate interrupt since URS is set
+    TIM1->CR1 = TIM1_CR1_URS;
+    TIM1->RCR = (uevCount > 0) ? getRepBlock(uevCount) : 0;
+    TIM1->EGR = TIM1_EGR_UG;
+    TIM1->SR1 = (uint8_t)(~TIM1_SR1_UIF);
+    if (uevCount > 0)
+    {
+        // Preload next block
+        note.uevLeft = (uevCount > TIM1_MAX_REP_BLOCK) ? uevCount - TIM1_MAX_REP_BLOCK : 0;
+        if (note.uevLeft > 0)
+            TIM1->RCR = getRepBlock(note.uevLeft);
+        TIM1->IER = TIM1_IER_UIE;
+    }
+
     // Set dead-time, enable outputs and start timer
-    TIM1->DTR = pTone->pwm_dt[volume];
+    bridgeActive = (tone != ToneSilence) ? BRIDGE_ACTIVE_MARK : 0;
+    TIM1->DTR = pTone->pwm_dt[vbatBucket][getEffectiveVolume(volume)];
 #if ENA_PWM_OUTPUT == 1
     TIM1->BKR = TIM1_BKR_AOE;       // Outputs will be enabled automatically at the next UEV
                                     // This is used to prevent incorrect dead-time generation at the start of the signal
                                     // and thus remove undesired audible clicks
 #endif
-    TIM1->CR1 = TIM1_CR1_CEN | TIM1_COUNTERMODE_CENTERALIGNED1;      // Timer enabled, center-aligned PWM mode
+    TIM1->CR1 = TIM1_CR1_CEN | TIM1_CR1_URS | TIM1_COUNTERMODE_CENTERALIGNED1;      // Timer enabled, center-aligned PWM mode
+}
+
+
+/**
+    Start continuous tone
+
+*/
+void PWM_Beep(eTone tone, eVolume volume)
+{
+    startTone(tone, volume, 0);
+}
+
+
+/**
+    Start tone of specified length
+
+    Tone length is counted by TIM1 in PWM half-periods, so it is exact and does not require CPU.
+    onPwmNoteDone() is called from ISR when tone is done, TIM1 keeps running until stopped or restarted.
+    @param ms Tone length, up to 2550 ms
+*/
+void PWM_BeepTimed(eTone tone, eVolume volume, uint16_t ms)
+{
+    uint16_t uevCount = (uint16_t)(((uint32_t)ms * 2000) / toneCtrl[tone].pwm_period);
+    startTone(tone, volume, (uevCount > 0) ? uevCount : 1);
+}
+
+
+/**
+    Select dead-time compensation for battery voltage
+
+    Applied to tones started after this call
+    @param mv Battery voltage [mV]
+*/
+void PWM_SetSupplyVoltage(uint16_t mv)
+{
+    uint8_t bucket = VbatHigh;
+
+    while (mv < vbatBucketMinMv[bucket])
+        bucket--;
+    vbatBucket = (eVbatBucket)bucket;
+}
+
+
+/**
+    Get estimated supply current for a tone
+
+    @return Current [mA]
+*/
+uint8_t PWM_GetCurrentMa(eTone tone, eVolume volume)
+{
+    return toneCurrentMa[tone][getEffectiveVolume(volume)];
+}
+
+
+/**
+    Set volume back-off
+
+    Applied to tones started after this call
+    @param steps Number of volume levels to step down, tones are not quieter than VolumeLow
+*/
+void PWM_SetVolumeBackoff(uint8_t steps)
+{
+    volumeBackoff = steps;
+}
+
+
+/**
+    Check if the last reset has occured while H-bridge was driven
+
+    Must be called before any PWM function at startup
+*/
+uint8_t PWM_IsResetDuringTone(void)
+{
+    return (bridgeActive == BRIDGE_ACTIVE_MARK);
 }
 
 
 void PWM_Stop(void)
 {
+    TIM1->IER = 0;
     TIM1->CR1 = 0;
     TIM1->BKR = 0;
+    bridgeActive = 0;
     TIM1->CNTRL = 0;
     TIM1->CNTRH = 0;
-    TIM1->IER = 0;
+#if ENA_BEEP_OUTPUT == 1
+    BEEP->CSR &= (uint8_t)(~BEEP_CSR_BEEPEN);
+#endif
+}
+
+
+/**
+    Measure LSI frequency against HSI
+
+    LSI is routed to TIM1 input capture 1 by AWU MSR bit. TIM1 must not be used for tones meanwhile.
+    Takes about 1ms.
+    @return LSI frequency [Hz]
+*/
+uint32_t PWM_MeasureLsiFreq(void)
+{
+    uint16_t first;
+    uint16_t last;
+    uint8_t i;
+
+    PWM_Stop();
+    TIM1->CCER1 = 0;                                // CCMR1 can be written only when channel is disabled
+    TIM1->PSCRH = 0;                                // Count at Fmaster
+    TIM1->PSCRL = 0;
+    TIM1->ARRH = 0xFF;
+    TIM1->ARRL = 0xFF;
+    TIM1->CCMR1 = (3 << 2) |                        // IC1PSC: capture is done once every 8 events
+                  (1 << 0);                         // CC1S: IC1 is mapped on TI1FP1
+    TIM1->CCER1 = TIM1_CCER1_CC1E;
+    TIM1->EGR = TIM1_EGR_UG;
+    AWU->CSR |= AWU_CSR_MSR;                        // LSI is connected to TIM1 ICAP1
+    TIM1->CR1 = TIM1_CR1_CEN;
+
+    // Reading CCR1L clears CC1IF
+    // First capture is used as a reference
+    for (i = 0; i <= LSI_MEAS_CAPTURES; i++)
+    {
+        while (!(TIM1->SR1 & TIM1_SR1_CC1IF));
+        last = (uint16_t)TIM1->CCR1H << 8;
+        last |= TIM1->CCR1L;
+        if (i == 0)
+            first = last;
+    }
+
+    TIM1->CR1 = 0;
+    AWU->CSR &= (uint8_t)(~AWU_CSR_MSR);
+    TIM1->CCER1 = 0;
+    TIM1->CCMR1 = 0;
+
+    return (F_MASTER_HZ * 8 * LSI_MEAS_CAPTURES) / (uint16_t)(last - first);
 }
 
 
+/**
+    Init BEEP peripheral for low-power tones
 
+    @param lsiFreqHz Measured LSI frequency, used for BEEP divider calibration
+*/
+void PWM_InitLowPower(uint32_t lsiFreqHz)
+{
+#if ENA_BEEP_OUTPUT == 1
+    BEEP->CSR &= (uint8_t)(~BEEP_CSR_BEEPEN);
+    BEEP_LSICalibrationConfig(lsiFreqHz);
+#else
+    (void)lsiFreqHz;
+#endif
+}
+
+
+/**
+    Check if low-power BEEP output is used for specified volume
+
+    BEEP output has a single fixed level, so it is used for all volume levels except VolumeHigh
+    which requires TIM1 H-bridge
+*/
+uint8_t PWM_IsLowPowerVolume(eVolume volume)
+{
+    return (ENA_BEEP_OUTPUT == 1) && (volume != VolumeHigh);
+}
+
+
+/**
+    Start low-power tone
+
+    BEEP peripheral is clocked by LSI and keeps running in active-halt.
+    Tone has to be stopped with PWM_Stop(), it's length is counted by caller.
+*/
+void PWM_BeepLowPower(eTone tone, eVolume volume)
+{
+    PWM_Stop();
+#if ENA_BEEP_OUTPUT == 1
+    if ((tone == ToneSilence) || (volume == VolumeSilent))
+        return;
+    BEEP->CSR = (uint8_t)((BEEP->CSR & (uint8_t)(~BEEP_CSR_BEEPSEL)) | beepFreq[tone]);
+    BEEP->CSR |= BEEP_CSR_BEEPEN;
+#else
+    (void)tone;
+    (void)volume;
+#endif
+}
+
+
+/**
+    ISR for TIM1 update
+    Counts tone length by blocks of repetition counter
+
+*/
+INTERRUPT_HANDLER(IRQ_Handler_TIM1_UPD, 11)
+{
+    uint16_t uevLeft = note.uevLeft;
+
+    TIM1->SR1 = (uint8_t)(~TIM1_SR1_UIF);
+    if (uevLeft == 0)
+    {
+        // Tone is done
+        TIM1->IER = 0;
+        onPwmNoteDone();
+        return;
+    }
+
+    // Block preloaded to RCR has just started, preload next one
+    uevLeft = (uevLeft > TIM1_MAX_REP_BLOCK) ? uevLeft - TIM1_MAX_REP_BLOCK : 0;
+    if (uevLeft > 0)
+        TIM1->RCR = getRepBlock(uevLeft);
+    note.uevLeft = uevLeft;
+}
@@ -6,7 +6,16 @@
 
 
 void PWM_Beep(eTone tone, eVolume volume);
+void PWM_BeepTimed(eTone tone, eVolume volume, uint16_t ms);
+void PWM_SetSupplyVoltage(uint16_t mv);
+uint8_t PWM_GetCurrentMa(eTone tone, eVolume volume);
+void PWM_SetVolumeBackoff(uint8_t steps);
+uint8_t PWM_IsResetDuringTone(void);
 void PWM_Stop(void);
+uint32_t PWM_MeasureLsiFreq(void);
+void PWM_InitLowPower(uint32_t lsiFreqHz);
+uint8_t PWM_IsLowPowerVolume(eVolume volume);
+void PWM_BeepLowPower(eTone tone, eVolume volume);
 
 
 
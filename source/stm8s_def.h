@@ -48,6 +48,15 @@
 // Common
 #define TIMx_CCMR1_CC1S_BPOS    0
 
+/**
+    TIMx_CCMR2
+*/
+// Capture mode
+#define TIMx_CCMR2_IC2F_BPOS    4
+#define TIMx_CCMR2_IC2PSC_BPOS  2
+// Common
+#define TIMx_CCMR2_CC2S_BPOS    0
+
 
 /**
     TIMx_SR1
@@ -58,7 +67,8 @@
 /**
     TIMx_SR2
 */
-#define TIMx_SR2_CC1OF_BPOS       0
+#define TIMx_SR2_CC2OF_BPOS       2
+#define TIMx_SR2_CC1OF_BPOS       1
 
 
 /**
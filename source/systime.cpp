@@ -0,0 +1,189 @@
+/**
+    @brief System time module
+    @author avegawanderer
+*/
+
+#include "global_def.h"
+#include "systime.h"
+#include "pwm.h"
+
+
+/*
+    System time is a 32-bit millisecond uptime counter, advanced by AWU interrupts.
+    LSI frequency is measured at startup against HSI, so AWU periods are compensated for
+    LSI deviation (+-12.5% over temperature and supply).
+
+    AWU is active only when CPU is executing power-saving instructions, WFI or HALT.
+    Time spent by CPU in active mode is not counted, so most of the time CPU must be sleeping.
+    Time counted by other timebases while AWU is stopped (TIM1 tones) is added with SysTime_Advance().
+*/
+
+#define AWU_MIN_APRDIV      2
+#define AWU_MAX_APRDIV      64
+
+// AWU time base for TBR = 1..14 [LSI periods]
+static const uint16_t awuTimeBase[] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 5 * 2048U, 30 * 2048U
+};
+
+
+volatile uint8_t sysFlag_TmrTick;
+
+static struct {
+    volatile uint32_t uptimeMs;
+    uint16_t fracUs;                // Sub-millisecond part of uptime
+    uint16_t awuPeriodMs;           // Current AWU period
+    uint16_t awuPeriodFracUs;
+    uint32_t lsiFreqHz;
+} sysTime = {
+    .lsiFreqHz = LSI_VALUE
+};
+
+
+/**
+    Initialize system time
+
+    Measures LSI frequency, LSI must be enabled and stable.
+*/
+void SysTime_Init(void)
+{
+    sysTime.lsiFreqHz = PWM_MeasureLsiFreq();
+    sysTime.uptimeMs = 0;
+    sysTime.fracUs = 0;
+}
+
+
+/**
+    Get system uptime
+
+    @return Uptime [ms]
+*/
+uint32_t SysTime_GetMs(void)
+{
+    uint32_t ms;
+    // 32-bit value is not read atomically, repeat if it has been updated by ISR
+    do {
+        ms = sysTime.uptimeMs;
+    } while (ms != sysTime.uptimeMs);
+    return ms;
+}
+
+
+/**
+    Add time counted by other timebase while AWU has been stopped
+
+    @param ms Elapsed time [ms]
+*/
+void SysTime_Advance(uint16_t ms)
+{
+    // AWU counts only while CPU is in WFI or HALT, so AWU ISR can not preempt this code
+    sysTime.uptimeMs += ms;
+}
+
+
+/**
+    Get measured LSI frequency
+
+    @return LSI frequency [Hz]
+*/
+uint32_t SysTime_GetLsiFreq(void)
+{
+    return sysTime.lsiFreqHz;
+}
+
+
+//=================================================================//
+// AWU management (used as timebase for FSM)
+
+
+/**
+    Set AWU period
+
+    @param period Time base in high byte, APR in low byte
+*/
+void setAwuPeriod(uint16_t period)
+{
+    uint8_t tbr = (uint8_t)(period >> 8);
+    uint8_t aprDiv = (uint8_t)(period & 0x3F) + 2;
+    uint32_t lsiFreqDiv8 = sysTime.lsiFreqHz / 8;
+    uint32_t scaled = (uint32_t)aprDiv * awuTimeBase[tbr - 1] * 125;       // LSI periods * 1000 / 8
+
+    // Actual period for measured LSI frequency
+    sysTime.awuPeriodMs = (uint16_t)(scaled / lsiFreqDiv8);
+    sysTime.awuPeriodFracUs = (uint16_t)(((scaled % lsiFreqDiv8) * 1000) / lsiFreqDiv8);
+
+    // Set the TimeBase
+    AWU->TBR &= (uint8_t)(~AWU_TBR_AWUTB);
+    AWU->TBR |= tbr;
+
+    // Set the APR divider
+    AWU->APR &= (uint8_t)(~AWU_APR_APR);
+    AWU->APR |= (uint8_t)(period & 0x3F);
+}
+
+
+/**
+    Set AWU period to the longest one not exceeding specified time
+
+    Largest usable time base is selected, so that APR divider provides the best resolution
+    @param ms Period, 1 to AWU_MAX_PERIOD_MS
+    @return Programmed period [ms]
+*/
+uint16_t setAwuPeriodMs(uint16_t ms)
+{
+    uint32_t cycles;
+    uint8_t tbr;
+    uint16_t aprDiv;
+
+    if (ms > AWU_MAX_PERIOD_MS)
+        ms = AWU_MAX_PERIOD_MS;
+    cycles = ((uint32_t)ms * (sysTime.lsiFreqHz / 8)) / 125;
+
+    // Find shortest time base which covers required period
+    for (tbr = 1; tbr < sizeof(awuTimeBase) / sizeof(awuTimeBase[0]); tbr++)
+    {
+        if (cycles <= (uint32_t)awuTimeBase[tbr - 1] * AWU_MAX_APRDIV)
+            break;
+    }
+    aprDiv = (uint16_t)(cycles / awuTimeBase[tbr - 1]);
+    if (aprDiv < AWU_MIN_APRDIV)
+        aprDiv = AWU_MIN_APRDIV;
+    if (aprDiv > AWU_MAX_APRDIV)
+        aprDiv = AWU_MAX_APRDIV;
+
+    setAwuPeriod(((uint16_t)tbr << 8) | (aprDiv - 2));
+    return sysTime.awuPeriodMs;
+}
+
+
+void startAwu(uint16_t period)
+{
+    setAwuPeriod(period);
+    AWU->CSR |= AWU_CSR_AWUEN;
+}
+
+
+void stopAwu(void)
+{
+    AWU->CSR &= (uint8_t)(~AWU_CSR_AWUEN);
+    AWU->TBR = (uint8_t)(~AWU_TBR_AWUTB);
+}
+
+
+INTERRUPT_HANDLER(IRQ_Handler_AWU, 1)
+{
+    volatile unsigned char reg;
+    // Reading AWU_CSR register clears the interrupt flag.
+    reg = AWU->CSR;
+
+    sysTime.uptimeMs += sysTime.awuPeriodMs;
+    sysTime.fracUs += sysTime.awuPeriodFracUs;
+    if (sysTime.fracUs >= 1000)
+    {
+        sysTime.fracUs -= 1000;
+        sysTime.uptimeMs++;
+    }
+
+    // Set global flag. Interrupt handler is used to run main loop.
+    sysFlag_TmrTick = 1;
+}
@@ -0,0 +1,31 @@
+#ifndef __SYSTIME_H__
+#define __SYSTIME_H__
+
+#include "global_def.h"
+
+
+// AWU periods for nominal LSI frequency
+#define AWU_1MS     ((3 << 8) | (32 - 2))
+#define AWU_10MS    ((6 << 8) | (40 - 2))
+#define AWU_100MS   ((9 << 8) | (50 - 2))
+
+#define AWU_MAX_PERIOD_MS   30000
+
+
+// Set by AWU ISR. Interrupt handler is used to run main loop.
+extern volatile uint8_t sysFlag_TmrTick;
+
+
+void SysTime_Init(void);
+uint32_t SysTime_GetMs(void);
+void SysTime_Advance(uint16_t ms);
+uint32_t SysTime_GetLsiFreq(void);
+
+void setAwuPeriod(uint16_t period);
+uint16_t setAwuPeriodMs(uint16_t ms);
+void startAwu(uint16_t period);
+void stopAwu(void);
+
+
+
+#endif  // __SYSTIME_H__
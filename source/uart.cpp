@@ -8,11 +8,179 @@
 #include "uart.h"
 
 
-/**
-    Initialize UART
+/*
+    Interrupt-driven half-duplex UART driver, single wire at UART1_TX pin (PD5).
+    Received bytes are put into RX ring buffer by RX ISR, messages are separated by idle line:
+    idle interrupt closes current message, and its length is put into message queue.
+    Main loop reads complete messages only, see UART_GetMessage().
+    Bytes from TX ring buffer are sent by TXE interrupt, TC interrupt ends transmission.
+
+    Half-duplex handling:
+        - transmission is not started while a message is being received, it is started
+          by idle interrupt instead
+        - every transmitted byte is received back, so the same number of bytes is dropped
+          by RX ISR. Echo that does not match transmitted byte is counted as collision.
+
+    UART requires Fmaster, so CPU must stay in WFI while UART_IsBusy() is set.
 
+    Wake-up:
+        UART is stopped in active-halt, so falling edge at idle line triggers PortD EXTI, which wakes CPU.
+        EXTI is then disabled until idle line, and UART_IsBusy() is kept set for UART_WAKE_WINDOW_MS
+        after the edge and after each received message (timed by TIM4), so CPU stays in WFI and
+        the following bytes are received. Byte that wakes CPU from halt is lost, so flight controller
+        must send a wake preamble: any single byte, then the frame within UART_WAKE_WINDOW_MS.
+
+    Autobaud:
+        Baud rate is found from sync byte UART_SYNC_BYTE that starts every command frame.
+        UART1_TX pin has no timer channel, so falling edge of start bit triggers PortD EXTI,
+        and ISR polls the pin timing the following edges by TIM4 clocked by Fmaster.
+        The first edge of each message is timed, edge pattern is checked, and the nearest supported
+        baud rate within HSI tolerance is taken.
+        Once baud rate is found, the remaining error of sync byte length is HSI error, since
+        flight controller is clocked by crystal. It is averaged over UART_TRIM_SAMPLES and
+        corrected by CLK_HSITRIMR, which improves all HSI-derived timings, not only UART.
+        Timing is skipped when HSI is trimmed, since it blocks other interrupts for a byte time.
+        While searching, ISR may block up to sync byte time at the lowest rate, once per message.
+        When baud rate is found, blocking is limited to sync byte time at that rate.
+        Framing errors in a row start search again.
 */
-void UART_Init(void)
+
+#define UART_RX_BUF_SIZE        32          // Power of 2
+#define UART_TX_BUF_SIZE        32          // Power of 2
+#define UART_MSG_QUEUE_SIZE     4           // Power of 2
+
+#define UART_CR2_TIEN           (1 << 7)
+#define UART_CR2_TCIEN          (1 << 6)
+#define UART_CR2_RIEN           (1 << 5)
+#define UART_CR2_ILIEN          (1 << 4)
+#define UART_CR2_TEN            (1 << 3)
+#define UART_CR2_REN            (1 << 2)
+
+#define UART_SR_ERRORS          (UART1_SR_OR | UART1_SR_NF | UART1_SR_FE)
+
+#define UART_DEFAULT_BAUD       9600
+#define UART_MIN_BAUD           9600
+
+// Fmaster from current HSI divider, it is changed by CRSF and DShot listening
+#define UART_FMASTER_HZ()       (HSI_VALUE >> ((CLK->CKDIVR & CLK_CKDIVR_HSIDIV) >> 3))
+#define UART_BRR(baud)          ((uint16_t)((UART_FMASTER_HZ() + (baud) / 2) / (baud)))
+
+// Sync byte 0xA5 after start bit, LSB first: edges at bits 1, 2, 3, 4, 6, 7, 8
+#define UART_SYNC_EDGES         7
+#define UART_SYNC_BITS          7           // Between the first and the last timed edge
+#define UART_SYNC_TIMEOUT_BITS  10          // The last edge is 8 bits after start edge, + 25%
+
+#define UART_BAUD_TOLERANCE     50          // Maximal HSI and measurement error [permille]
+#define UART_TRIM_SAMPLES       8
+#define UART_TRIM_THRESHOLD     5           // HSI error to be corrected [permille]
+#define UART_TRIM_MIN           (-4)        // HSITRIM is 3-bit signed
+#define UART_TRIM_MAX           3
+#define UART_FE_RESTART         4           // Framing errors in a row to restart autobaud
+
+#define UART_WAKE_WINDOW_MS     8           // Up to 255 TIM4 ticks at Fmaster / 128
+
+
+// UART mode, RX interrupt is shared
+enum {
+    UartModeOff,
+    UartModeDriver,
+    UartModeCrsf
+};
+
+
+static struct {
+    uint8_t rxBuf[UART_RX_BUF_SIZE];
+    uint8_t txBuf[UART_TX_BUF_SIZE];
+    uint8_t msgLen[UART_MSG_QUEUE_SIZE];
+    volatile uint8_t rxHead;                // Written by ISR
+    uint8_t rxTail;
+    volatile uint8_t msgHead;               // Written by ISR
+    uint8_t msgTail;
+    uint8_t rxCount;                        // Bytes of message being received
+    uint8_t txHead;
+    volatile uint8_t txTail;                // Written by ISR
+    volatile uint8_t echoCount;             // Transmitted bytes not received back yet
+    uint8_t echoTail;                       // Position of expected echo in TX buffer
+    volatile uint8_t isTxActive;
+    volatile uint8_t isRxActive;            // Message is being received
+    volatile uint8_t isLineActive;          // Edge seen at idle line, EXTI is disabled until idle line
+    volatile uint8_t isWaking;              // Wake window is running
+    uint8_t mode;
+    uint8_t isInit;                         // Driver mode is restored after CRSF listening
+    uartErrors_t errors;
+} uart;
+
+
+// Autobaud state
+enum {
+    AutobaudSearch,
+    AutobaudTrim,
+    AutobaudDone
+};
+
+static struct {
+    uint8_t state;
+    uint16_t baud;
+    uint8_t feCount;                        // Framing errors in a row
+    int8_t trim;                            // Current HSITRIM
+    int8_t lastStep;
+    uint8_t sampleCount;
+    int16_t errorSum;                       // Sum of HSI errors [permille]
+    uint8_t timeoutWraps;                   // Sync byte timeout at found rate [TIM4 wraps]
+    uint8_t searchTimeoutWraps;             // Sync byte timeout at the lowest rate
+} autobaud;
+
+// Supported baud rates
+// Bit time must exceed active-halt wake-up time (about 50us with MVR off and slow wake-up),
+// otherwise edges after start bit are missed when sync byte wakes CPU
+static const uint16_t uartBaudRates[] = {
+    UART_MIN_BAUD, 19200
+};
+
+// Positions of timed sync byte edges [bits]
+static const uint8_t syncEdgeBits[UART_SYNC_EDGES] = {
+    1, 2, 3, 4, 6, 7, 8
+};
+
+
+static void incError(uint8_t *counter)
+{
+    if (*counter != 0xFF)
+        (*counter)++;
+}
+
+
+// EXTI is enabled at idle line in driver mode, own transmission is skipped
+static void updateWakeIrq(void)
+{
+    if ((uart.mode == UartModeDriver) && !uart.isTxActive && !uart.isLineActive)
+        GPIOD->CR2 |= GPD_UART_PIN;
+    else
+        GPIOD->CR2 &= (uint8_t)(~GPD_UART_PIN);
+}
+
+
+// Sync byte timeout [TIM4 wraps of 256 Fmaster ticks]
+static uint8_t getSyncTimeout(uint16_t baud)
+{
+    return (uint8_t)(((UART_FMASTER_HZ() >> 8) * UART_SYNC_TIMEOUT_BITS) / baud);
+}
+
+
+static void setBaudRate(void)
+{
+    uint16_t brr = UART_BRR(autobaud.baud);
+    UART1->BRR2 = BRR2(brr);                // BRR2 must be written first
+    UART1->BRR1 = BRR1(brr);
+
+    // ISR must not block longer than sync byte
+    autobaud.timeoutWraps = getSyncTimeout(autobaud.baud);
+    autobaud.searchTimeoutWraps = getSyncTimeout(UART_MIN_BAUD);
+}
+
+
+// Configure UART for driver mode
+static void configDriver(void)
 {
     UART1->CR1 =    (0 << 5) |          // 0: UART enabled (no low power mode)
                     (0 << 4) |          // 8-n-ss, ss = 1 or 2 stop bits depending on CR3
@@ -21,15 +189,6 @@ void UART_Init(void)
                     (0 << 1) |          // Parity selection
                     (0 << 0);           // Parity interrupt disabled
 
-    UART1->CR2 =    (0 << 7) |          // TIEN interrupt
-                    (0 << 6) |          // TCIEN
-                    (0 << 5) |          // RIEN
-                    (0 << 4) |          // ILEN
-                    (1 << 3) |          // Enable transmitter
-                    (1 << 2) |          // Enable receiver
-                    (0 << 1) |          // mute mode
-                    (0 << 0);           // break char
-
     UART1->CR3 =    (0 << 6) |          // LIN mode disabled
                     (0 << 4) |          // 1 stop bit
                     (0 << 3) |          // SLK pin disabled
@@ -48,53 +207,699 @@ void UART_Init(void)
     UART1->GTR =    0x00;               // Smartcard-related
     UART1->PSCR =   0;                  // Smartcard and IrDA-related
 
-    // BRR for 9600 @ 2MHz = 208.(3) = 0xD0
-    uint8_t brr1 = BRR1(208);
-    uint8_t brr2 = BRR2(208);
-    UART1->BRR2 = brr2;
-    UART1->BRR1 = brr1;
+    // Baud rate found by autobaud or default
+    setBaudRate();
+
+    UART1->CR2 =    (0 << 7) |          // TIEN interrupt, enabled when TX buffer is not empty
+                    (0 << 6) |          // TCIEN, enabled for the last byte
+                    (1 << 5) |          // RIEN
+                    (1 << 4) |          // ILIEN
+                    (1 << 3) |          // Enable transmitter
+                    (1 << 2) |          // Enable receiver
+                    (0 << 1) |          // mute mode
+                    (0 << 0);           // break char
+    uart.mode = UartModeDriver;
+    uart.isLineActive = 0;
+    updateWakeIrq();
+}
+
+
+// Keep CPU out of halt for UART_WAKE_WINDOW_MS, restarted if running
+static void startWakeWindow(void)
+{
+    TIM4->CR1 = TIM4_CR1_URS;
+    TIM4->IER = 0;
+    TIM4->PSCR = 7;                         // Fmaster / 128
+    TIM4->ARR = (uint8_t)(((UART_FMASTER_HZ() >> 7) * UART_WAKE_WINDOW_MS) / 1000);
+    TIM4->CNTR = 0;
+    TIM4->EGR = TIM4_EGR_UG;                // Load prescaler, no interrupt since URS is set
+    TIM4->SR1 = (uint8_t)(~TIM4_SR1_UIF);
+    TIM4->IER = TIM4_IER_UIE;
+    TIM4->CR1 = TIM4_CR1_CEN | TIM4_CR1_URS;
+    uart.isWaking = 1;
+}
+
+
+/**
+    Initialize UART
+
+*/
+void UART_Init(void)
+{
+    uart.rxHead = 0;
+    uart.rxTail = 0;
+    uart.msgHead = 0;
+    uart.msgTail = 0;
+    uart.rxCount = 0;
+    uart.txHead = 0;
+    uart.txTail = 0;
+    uart.echoCount = 0;
+    uart.isTxActive = 0;
+    uart.isRxActive = 0;
+    uart.isWaking = 0;
+    uart.isInit = 1;
+    autobaud.state = AutobaudSearch;
+    autobaud.baud = UART_DEFAULT_BAUD;
+    autobaud.feCount = 0;
+    configDriver();
+}
+
+
+// Start transmission if there is data and line is free
+static void startTx(void)
+{
+    if (!uart.isTxActive && !uart.isRxActive && (uart.txHead != uart.txTail))
+    {
+        uart.isTxActive = 1;
+        updateWakeIrq();
+        UART1->CR2 |= UART_CR2_TIEN;
+    }
+}
+
+
+/**
+    Put message into TX buffer
+
+    @param data Message bytes
+    @param length Message length
+    @return 1 if message is queued, 0 if there is not enough space
+*/
+uint8_t UART_Send(const uint8_t *data, uint8_t length)
+{
+    uint8_t head = uart.txHead;
+    uint8_t free = (uint8_t)(UART_TX_BUF_SIZE - 1 - ((head - uart.txTail) & (UART_TX_BUF_SIZE - 1)));
+
+    if ((uart.mode != UartModeDriver) || (length > free))
+        return 0;
+    while (length--)
+    {
+        uart.txBuf[head] = *data++;
+        head = (head + 1) & (UART_TX_BUF_SIZE - 1);
+    }
+    disableInterrupts();
+    uart.txHead = head;
+    startTx();
+    enableInterrupts();
+    return 1;
+}
+
+
+/**
+    Get complete received message
+
+    @param data Buffer for message
+    @param maxLength Buffer size, longer message is truncated
+    @return Message length, 0 if there are no complete messages
+*/
+uint8_t UART_GetMessage(uint8_t *data, uint8_t maxLength)
+{
+    uint8_t length;
+    uint8_t i;
+
+    if (uart.msgTail == uart.msgHead)
+        return 0;
+    length = uart.msgLen[uart.msgTail];
+    uart.msgTail = (uart.msgTail + 1) & (UART_MSG_QUEUE_SIZE - 1);
+    for (i = 0; i < length; i++)
+    {
+        if (i < maxLength)
+            data[i] = uart.rxBuf[uart.rxTail];
+        uart.rxTail = (uart.rxTail + 1) & (UART_RX_BUF_SIZE - 1);
+    }
+    return (length < maxLength) ? length : maxLength;
+}
+
+
+/**
+    Get status of UART
+
+    @return 1 if bytes are being transmitted or received, or wake window is running,
+            CPU must not enter active-halt
+*/
+uint8_t UART_IsBusy(void)
+{
+    return uart.isTxActive || uart.isRxActive || uart.isWaking;
+}
+
+
+/**
+    Get error counters
+
+    @param errors Copy of counters, saturated at 255
+*/
+void UART_GetErrors(uartErrors_t *errors)
+{
+    *errors = uart.errors;
+}
+
+
+/**
+    Check for received messages
+
+    @return 1 if there is complete message, see UART_GetMessage()
+*/
+uint8_t UART_IsMessageReady(void)
+{
+    return (uart.msgTail != uart.msgHead);
+}
+
+
+// Process received byte in driver mode
+static void receiveByte(uint8_t sr, uint8_t data)
+{
+    uint8_t head;
+
+    if (uart.echoCount != 0)
+    {
+        // Own byte received back
+        uart.echoCount--;
+        if ((sr & UART_SR_ERRORS) || (data != uart.txBuf[uart.echoTail]))
+            incError(&uart.errors.collision);
+        uart.echoTail = (uart.echoTail + 1) & (UART_TX_BUF_SIZE - 1);
+        return;
+    }
+
+    if (sr & UART1_SR_OR)
+        incError(&uart.errors.overrun);
+    if (sr & UART1_SR_FE)
+    {
+        incError(&uart.errors.framing);
+        // Baud rate of flight controller may have been changed
+        if ((autobaud.state != AutobaudSearch) && (++autobaud.feCount >= UART_FE_RESTART))
+            autobaud.state = AutobaudSearch;
+    }
+    else
+    {
+        autobaud.feCount = 0;
+    }
+    if (sr & UART1_SR_NF)
+        incError(&uart.errors.noise);
+
+    uart.isRxActive = 1;
+    head = (uart.rxHead + 1) & (UART_RX_BUF_SIZE - 1);
+    if ((head == uart.rxTail) || (((uart.msgHead + 1) & (UART_MSG_QUEUE_SIZE - 1)) == uart.msgTail))
+    {
+        incError(&uart.errors.rxOverflow);
+        return;
+    }
+    uart.rxBuf[uart.rxHead] = data;
+    uart.rxHead = head;
+    uart.rxCount++;
+}
+
+
+// Idle line, message is complete
+static void receiveIdle(void)
+{
+    uart.isRxActive = 0;
+    if (uart.rxCount != 0)
+    {
+        uart.msgLen[uart.msgHead] = uart.rxCount;
+        uart.msgHead = (uart.msgHead + 1) & (UART_MSG_QUEUE_SIZE - 1);
+        uart.rxCount = 0;
+    }
+    // Next message may follow a reply
+    uart.isLineActive = 0;
+    updateWakeIrq();
+    startWakeWindow();
+    startTx();
+}
+
+
+INTERRUPT_HANDLER(IRQ_Handler_UART1_TX, 17)
+{
+    uint8_t tail = uart.txTail;
+
+    if ((UART1->CR2 & UART_CR2_TIEN) && (UART1->SR & UART1_SR_TXE))
+    {
+        if (tail != uart.txHead)
+        {
+            if (uart.echoCount == 0)
+                uart.echoTail = tail;
+            uart.echoCount++;
+            UART1->DR = uart.txBuf[tail];
+            uart.txTail = (tail + 1) & (UART_TX_BUF_SIZE - 1);
+        }
+        else
+        {
+            // Buffer is empty, wait for the last byte
+            UART1->CR2 = (UART1->CR2 & (uint8_t)(~UART_CR2_TIEN)) | UART_CR2_TCIEN;
+        }
+    }
+    else if ((UART1->CR2 & UART_CR2_TCIEN) && (UART1->SR & UART1_SR_TC))
+    {
+        UART1->CR2 &= (uint8_t)(~UART_CR2_TCIEN);
+        UART1->SR = (uint8_t)(~UART1_SR_TC);
+        uart.isTxActive = 0;
+        updateWakeIrq();
+        startTx();
+    }
+}
+
+
+//=================================================================//
+// Autobaud
+
 
+/**
+    Get baud rate
+
+    @return Baud rate found by autobaud, default rate if it is not found yet
+*/
+uint16_t UART_GetBaudRate(void)
+{
+    return autobaud.baud;
 }
 
 
 /**
-    Run UART processing
+    Get HSI trimming
 
+    @return Signed HSITRIM value set by autobaud
 */
-void UART_Process(void)
+int8_t UART_GetHsiTrim(void)
+{
+    return autobaud.trim;
+}
+
+
+// Time sync byte edges after start bit by TIM4, runs with interrupts blocked
+// Returns length of UART_SYNC_BITS [Fmaster ticks], 0 if edges do not match sync byte
+static uint16_t measureSyncByte(void)
+{
+    uint16_t edgeTime[UART_SYNC_EDGES];
+    uint16_t length;
+    uint16_t expected;
+    uint8_t timeoutWraps = (autobaud.state == AutobaudSearch) ? autobaud.searchTimeoutWraps : autobaud.timeoutWraps;
+    uint8_t level = 0;                      // Start bit
+    uint8_t wraps = 0;
+    uint8_t prev = 0;
+    uint8_t cnt;
+    uint8_t i;
+
+    TIM4->IER = 0;                          // Wake window is restarted after
+    TIM4->PSCR = 0;
+    TIM4->ARR = 0xFF;
+    TIM4->CNTR = 0;
+    TIM4->CR1 = TIM4_CR1_CEN;
+    for (i = 0; i < UART_SYNC_EDGES; i++)
+    {
+        level ^= GPD_UART_PIN;
+        while ((GPIOD->IDR & GPD_UART_PIN) != level)
+        {
+            cnt = TIM4->CNTR;
+            if ((cnt < prev) && (++wraps >= timeoutWraps))
+            {
+                TIM4->CR1 = 0;
+                return 0;
+            }
+            prev = cnt;
+        }
+        edgeTime[i] = ((uint16_t)wraps << 8) | prev;
+    }
+    TIM4->CR1 = 0;
+
+    // Every edge must be within a quarter of bit from its position
+    length = edgeTime[UART_SYNC_EDGES - 1] - edgeTime[0];
+    for (i = 1; i < UART_SYNC_EDGES - 1; i++)
+    {
+        expected = (uint16_t)(((uint32_t)length * (syncEdgeBits[i] - syncEdgeBits[0])) / UART_SYNC_BITS);
+        if ((uint16_t)(edgeTime[i] - edgeTime[0] - expected + length / (4 * UART_SYNC_BITS)) >
+            length / (2 * UART_SYNC_BITS))
+            return 0;
+    }
+    return length;
+}
+
+
+// Step HSI trimming by averaged error of sync byte length
+static void trimHsi(int16_t error)
+{
+    int8_t step = 0;
+
+    autobaud.errorSum += error;
+    if (++autobaud.sampleCount < UART_TRIM_SAMPLES)
+        return;
+    error = autobaud.errorSum / UART_TRIM_SAMPLES;
+    autobaud.sampleCount = 0;
+    autobaud.errorSum = 0;
+
+    // Sync byte longer than nominal means HSI is fast
+    if (error > UART_TRIM_THRESHOLD)
+        step = -1;
+    else if (error < -UART_TRIM_THRESHOLD)
+        step = 1;
+
+    // Done if error is small, out of trimming range, or the previous step overshot
+    if ((step == 0) || (step == -autobaud.lastStep) ||
+        (autobaud.trim + step < UART_TRIM_MIN) || (autobaud.trim + step > UART_TRIM_MAX))
+    {
+        autobaud.state = AutobaudDone;
+        return;
+    }
+    autobaud.trim += step;
+    autobaud.lastStep = step;
+    CLK->HSITRIMR = (uint8_t)autobaud.trim & CLK_HSITRIMR_HSITRIM;
+}
+
+
+// Match sync byte length to supported baud rates
+static void processSyncByte(uint16_t length)
+{
+    uint32_t fmaster = UART_FMASTER_HZ();
+    uint32_t nominal;
+    int16_t error = 0;
+    uint8_t i;
+
+    for (i = 0; i < sizeof(uartBaudRates) / sizeof(uartBaudRates[0]); i++)
+    {
+        nominal = (fmaster * UART_SYNC_BITS) / uartBaudRates[i];
+        error = (int16_t)((((int32_t)length - (int32_t)nominal) * 1000) / (int32_t)nominal);
+        if ((error > -UART_BAUD_TOLERANCE) && (error < UART_BAUD_TOLERANCE))
+            break;
+    }
+    if (i == sizeof(uartBaudRates) / sizeof(uartBaudRates[0]))
+        return;
+
+    if ((autobaud.state == AutobaudSearch) || (uartBaudRates[i] != autobaud.baud))
+    {
+        // Sync byte itself is lost, sender retries
+        autobaud.baud = uartBaudRates[i];
+        autobaud.state = AutobaudTrim;
+        autobaud.feCount = 0;
+        autobaud.lastStep = 0;
+        autobaud.sampleCount = 0;
+        autobaud.errorSum = 0;
+        setBaudRate();
+        return;
+    }
+    trimHsi(error);
+}
+
+
+INTERRUPT_HANDLER(IRQ_Handler_GPIOD, 6)
 {
-    static uint8_t data8 = 0;
-    static uint8_t data_rd;
-    // Simple loop
+    uint16_t length;
 
-    if (UART1->SR & (1 << 5))
+    // UART pin is the only interrupt source at PortD
+    if (uart.mode != UartModeDriver)
+        return;
+    uart.isLineActive = 1;
+    updateWakeIrq();
+    if (autobaud.state != AutobaudDone)
     {
-        data_rd = UART1->DR;
-        data8 = data_rd;
-        
-        UART1->DR = data8;
-        // Wait for transmitt
-        while (!(UART1->SR & (1 << 6)));
-        // Wait for self receive
-        while ((!UART1->SR & (1 << 5)));
-        // Read out echo
-        data_rd = UART1->DR;
+        length = measureSyncByte();
+        if (length != 0)
+            processSyncByte(length);
     }
+    startWakeWindow();
+}
+
+
+// Wake window is over
+INTERRUPT_HANDLER(IRQ_Handler_TIM4_UPD, 23)
+{
+    TIM4->CR1 = 0;
+    TIM4->IER = 0;
+    TIM4->SR1 = (uint8_t)(~TIM4_SR1_UIF);
+    uart.isWaking = 0;
+    // Edge has not started a byte, e.g. preamble lost in halt
+    if (!uart.isRxActive)
+    {
+        uart.isLineActive = 0;
+        updateWakeIrq();
+    }
+}
+
+
+//=================================================================//
+// CRSF link monitor
+
 /*
-    data8++;
-    UART1->DR = data8;
-    // Wait for transmitt
-    while (!(UART1->SR & (1 << 6)));
-    // Wait for self receive
-    while ((!UART1->SR & (1 << 5)));
-    // Read out echo
-    data_rd = UART1->DR;
+    Receive-only sniffing of CRSF stream between receiver and flight controller.
+    CRSF is 420 kbaud 8-n-1, which requires Fmaster = 16MHz (BRR = 38, +0.25% error),
+    so Fmaster is raised only while listening. Peripherals clocked by Fmaster must be idle
+    or use prescaler derived from current clock meanwhile.
+
+    Frame: [address] [length] [type] [payload] [CRC8 DVB-S2 of type and payload]
+    Bytes are stored in place by RX ISR and CRC is updated per byte, so complete frame is
+    checked and parsed without copying. Only link statistics and presence of RC channels
+    frames are used:
+        - link is lost if uplink link quality is 0 (receiver failsafe)
+        - or no RC channels frame has been received for CRSF_LINK_LOST_MS of listening time
 */
+
+#define CRSF_BRR                        38          // 16MHz / 420000
+#define CRSF_MAX_FRAME                  64
+#define CRSF_MIN_LENGTH                 2           // Type and CRC
+
+#define CRSF_ADDRESS_FLIGHT_CONTROLLER  0xC8
+#define CRSF_ADDRESS_RADIO_TRANSMITTER  0xEA
+#define CRSF_ADDRESS_RECEIVER           0xEC
+#define CRSF_ADDRESS_TRANSMITTER_MODULE 0xEE
+
+#define CRSF_FRAMETYPE_LINK_STATISTICS  0x14
+#define CRSF_FRAMETYPE_RC_CHANNELS      0x16
+
+// Offset of uplink link quality in frame buffer
+#define CRSF_LINK_STATS_LQ_POS          5
+
+#define CRSF_LINK_LOST_MS               1000
+
+
+static struct {
+    uint8_t buf[CRSF_MAX_FRAME];
+    uint8_t index;
+    uint8_t crc;
+    volatile uint8_t isPresent;             // Valid frames have been received
+    volatile uint8_t isRcFrame;             // RC channels frame received since last check
+    volatile uint8_t linkQuality;           // Uplink link quality [%]
+    volatile uint8_t errors;                // Byte or CRC errors, saturated
+    uint16_t lostMs;
+} crsf;
+
+
+
+/**
+    Update CRC8 DVB-S2, used by CRSF and command frames
+
+    @param crc CRC of previous bytes, 0 for the first byte
+    @param data Next byte
+    @return Updated CRC
+*/
+uint8_t UART_Crc8(uint8_t crc, uint8_t data)
+{
+    uint8_t i;
+    crc ^= data;
+    for (i = 0; i < 8; i++)
+    {
+        crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0xD5) : (uint8_t)(crc << 1);
+    }
+    return crc;
 }
 
 
+/**
+    Reset CRSF link state
+
+    Must be called when receiver may have been changed
+*/
+void UART_ResetCrsf(void)
+{
+    crsf.isPresent = 0;
+    crsf.isRcFrame = 0;
+    crsf.linkQuality = 100;
+    crsf.errors = 0;
+    crsf.lostMs = 0;
+}
 
 
+/**
+    Suspend driver mode
 
+    Must be called before Fmaster is changed, followed by UART_Resume().
+    UART_IsBusy() must be checked before.
+*/
+void UART_Suspend(void)
+{
+    UART1->CR2 = 0;
+    uart.mode = UartModeOff;
+    updateWakeIrq();
+}
 
 
+/**
+    Resume driver mode
+
+    Baud rate is set for current Fmaster, queued data is sent
+*/
+void UART_Resume(void)
+{
+    if (uart.isInit)
+    {
+        uart.rxCount = 0;
+        configDriver();
+        startTx();
+    }
+}
+
+
+/**
+    Start listening to CRSF stream
+
+    Switches Fmaster to 16MHz. Must be followed by UART_StopCrsf()
+    Driver mode is suspended, UART_IsBusy() must be checked before.
+*/
+void UART_StartCrsf(void)
+{
+    UART_Suspend();
+    uart.mode = UartModeCrsf;
+    CLK_SYSCLKConfig(CLK_PRESCALER_HSIDIV1);                // Fmaster = 16MHz
+
+    UART1->CR1 = 0;                                         // 8-n-1, UART enabled
+    UART1->CR3 = 0;                                         // 1 stop bit
+    UART1->CR5 = (1 << 3);                                  // Half-duplex mode, shared pin is RX only
+    UART1->BRR2 = BRR2(CRSF_BRR);                           // BRR2 must be written first
+    UART1->BRR1 = BRR1(CRSF_BRR);
+
+    crsf.index = 0;
+    (void)UART1->SR;                                        // Clear pending errors
+    (void)UART1->DR;
+    UART1->CR2 =    (1 << 5) |                              // RIEN
+                    (1 << 2);                               // Enable receiver
+}
+
+
+/**
+    Stop listening to CRSF stream
+
+    Restores Fmaster and driver mode
+*/
+void UART_StopCrsf(void)
+{
+    UART1->CR2 = 0;
+    uart.mode = UartModeOff;
+    CLK_SYSCLKConfig(CLK_PRESCALER_HSIDIV4);                // Fmaster = 4MHz
+    UART_Resume();
+}
+
+
+/**
+    Update CRSF link state
+
+    @param listenMs Time spent listening since previous call
+    @return eCrsfLink
+*/
+eCrsfLink UART_ProcessCrsf(uint16_t listenMs)
+{
+    if (!crsf.isPresent)
+        return CrsfNone;
+
+    if (crsf.isRcFrame)
+    {
+        crsf.isRcFrame = 0;
+        crsf.lostMs = 0;
+    }
+    else if (crsf.lostMs < CRSF_LINK_LOST_MS)
+    {
+        crsf.lostMs += listenMs;
+    }
+    return ((crsf.lostMs >= CRSF_LINK_LOST_MS) || (crsf.linkQuality == 0)) ? CrsfLinkLost : CrsfLinkUp;
+}
+
+
+uint8_t UART_IsCrsfPresent(void)
+{
+    return crsf.isPresent;
+}
+
+
+uint8_t UART_GetCrsfLinkQuality(void)
+{
+    return crsf.linkQuality;
+}
+
+
+// Parse complete frame in place
+static void parseCrsfFrame(void)
+{
+    switch (crsf.buf[2])
+    {
+        case CRSF_FRAMETYPE_LINK_STATISTICS:
+            crsf.linkQuality = crsf.buf[CRSF_LINK_STATS_LQ_POS];
+            break;
+        case CRSF_FRAMETYPE_RC_CHANNELS:
+            crsf.isRcFrame = 1;
+            break;
+    }
+    crsf.isPresent = 1;
+}
+
+
+// Process received CRSF byte
+static void receiveCrsf(uint8_t sr, uint8_t data)
+{
+    uint8_t index = crsf.index;
+
+    if (sr & UART_SR_ERRORS)
+    {
+        // Frame is broken, resync at next address byte
+        crsf.index = 0;
+        if (crsf.errors != 0xFF)
+            crsf.errors++;
+        return;
+    }
+
+    if (index == 0)
+    {
+        if ((data != CRSF_ADDRESS_FLIGHT_CONTROLLER) && (data != CRSF_ADDRESS_RADIO_TRANSMITTER) &&
+            (data != CRSF_ADDRESS_RECEIVER) && (data != CRSF_ADDRESS_TRANSMITTER_MODULE))
+            return;
+    }
+    else if (index == 1)
+    {
+        if ((data < CRSF_MIN_LENGTH) || (data > CRSF_MAX_FRAME - 2))
+        {
+            crsf.index = 0;
+            return;
+        }
+        crsf.crc = 0;
+    }
+    else if (index < crsf.buf[1] + 1)
+    {
+        crsf.crc = UART_Crc8(crsf.crc, data);
+    }
+    else
+    {
+        // CRC byte, frame is complete
+        crsf.index = 0;
+        if (data == crsf.crc)
+            parseCrsfFrame();
+        else if (crsf.errors != 0xFF)
+            crsf.errors++;
+        return;
+    }
+    crsf.buf[index] = data;
+    crsf.index = index + 1;
+}
+
+
+INTERRUPT_HANDLER(IRQ_Handler_UART1_RX, 18)
+{
+    // Reading SR then DR clears RXNE, IDLE and error flags
+    uint8_t sr = UART1->SR;
+    uint8_t data = UART1->DR;
+
+    if (uart.mode == UartModeCrsf)
+    {
+        if (sr & UART1_SR_RXNE)
+            receiveCrsf(sr, data);
+    }
+    else if (uart.mode == UartModeDriver)
+    {
+        if (sr & UART1_SR_RXNE)
+            receiveByte(sr, data);
+        if (sr & UART1_SR_IDLE)
+            receiveIdle();
+    }
+}
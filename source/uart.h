@@ -4,8 +4,44 @@
 #include "global_def.h"
 
 
+// First byte of command frames, used for autobaud
+#define UART_SYNC_BYTE      0xA5
+
+// CRSF link state
+typedef enum {
+    CrsfNone,           // No CRSF stream detected
+    CrsfLinkUp,
+    CrsfLinkLost,       // Receiver failsafe or no RC frames
+} eCrsfLink;
+
+
+// Error counters, saturated
+typedef struct {
+    uint8_t overrun;
+    uint8_t framing;
+    uint8_t noise;
+    uint8_t collision;          // Echo of transmitted byte does not match
+    uint8_t rxOverflow;         // RX buffer or message queue is full
+} uartErrors_t;
+
+
 void UART_Init(void);
-void UART_Process(void);
+uint8_t UART_Send(const uint8_t *data, uint8_t length);
+uint8_t UART_GetMessage(uint8_t *data, uint8_t maxLength);
+uint8_t UART_IsBusy(void);
+void UART_GetErrors(uartErrors_t *errors);
+uint8_t UART_IsMessageReady(void);
+uint8_t UART_Crc8(uint8_t crc, uint8_t data);
+void UART_Suspend(void);
+void UART_Resume(void);
+void UART_ResetCrsf(void);
+void UART_StartCrsf(void);
+void UART_StopCrsf(void);
+eCrsfLink UART_ProcessCrsf(uint16_t listenMs);
+uint8_t UART_IsCrsfPresent(void);
+uint8_t UART_GetCrsfLinkQuality(void);
+uint16_t UART_GetBaudRate(void);
+int8_t UART_GetHsiTrim(void);
 
 
 
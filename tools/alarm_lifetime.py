@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+Expected alarm lifetime for buzzer alarm schedules
+
+Mirrors almSchedule, default alarm periods (cfgDefault), alarm patterns and UV_CUTOFF_MV from
+source/main.cpp, tone currents from source/pwm.cpp, MCU currents and open-circuit voltage curve
+from source/gauge.cpp. Keep them in sync.
+
+Battery is drained down to over-discharge cutoff, as firmware does.
+
+Usage: alarm_lifetime.py [capacity_mah] [start_soc_percent]
+"""
+
+import sys
+
+# MCU supply currents [uA]
+ACTIVE_HALT_UA = 70
+WFI_UA = 600
+
+# Over-discharge cutoff [mV] and Li-Po open-circuit voltage for 0%, 10% ... 100% SoC [mV]
+UV_CUTOFF_MV = 3300
+SOC_VOLTAGE_MV = [3270, 3690, 3730, 3770, 3800, 3840, 3870, 3950, 4020, 4110, 4200]
+
+# Tone currents at VolumeHigh and VolumeMedium [mA], see toneCurrentMa in pwm.cpp
+TONE_MA = {
+    'Tone1': {'High': 40, 'Medium': 10},
+    'Tone2': {'High': 33, 'Medium': 7},
+    'Tone3': {'High': 38, 'Medium': 16},
+    'Tone4': {'High': 42, 'Medium': 31},
+}
+
+# Patterns as lists of (tone, duration [ms]) and volume limit
+PATTERNS = {
+    'alarm3': (3 * [('Tone4', 50), ('Tone1', 80)], 'High'),
+    'alarm4': ([('Tone4', 50), ('Tone1', 80)], 'High'),
+    'alarm5': ([('Tone4', 50), ('Tone1', 80)], 'Medium'),
+}
+
+# Schedules: (start [min], max SoC [%], period [ms], pattern)
+SCHEDULES = {
+    'current': [
+        (0,   100, 5000,  'alarm3'),
+        (30,  60,  15000, 'alarm3'),
+        (120, 30,  20000, 'alarm4'),
+        (360, 10,  30000, 'alarm5'),
+    ],
+    'two-stage (original)': [
+        (0,   100, 5000,  'alarm3'),
+        (30,  0,   15000, 'alarm3'),
+    ],
+}
+
+
+def pattern_charge(name):
+    """Return (on-time [ms], charge [uA*ms]) of a single alarm signal"""
+    notes, volume = PATTERNS[name]
+    on_ms = sum(ms for _, ms in notes)
+    charge = sum(ms * (TONE_MA[tone][volume] * 1000 + WFI_UA - ACTIVE_HALT_UA) for tone, ms in notes)
+    return on_ms, charge
+
+
+def voltage_soc(mv):
+    """State of charge [%] for open-circuit voltage, linear interpolation as in gauge.cpp"""
+    if mv <= SOC_VOLTAGE_MV[0]:
+        return 0.0
+    for i in range(1, len(SOC_VOLTAGE_MV)):
+        if mv < SOC_VOLTAGE_MV[i]:
+            return (i - 1) * 10 + 10.0 * (mv - SOC_VOLTAGE_MV[i - 1]) / (SOC_VOLTAGE_MV[i] - SOC_VOLTAGE_MV[i - 1])
+    return 100.0
+
+
+def simulate(schedule, capacity_mah, start_soc):
+    capacity_uams = capacity_mah * 1000 * 3600 * 1000
+    cutoff = capacity_uams * voltage_soc(UV_CUTOFF_MV) / 100
+    remaining = capacity_uams * start_soc / 100 - cutoff
+    t_ms = 0
+    stage = 0
+    stats = [[0, 0] for _ in schedule]      # time [ms], audible time [ms] per stage
+
+    while remaining > 0:
+        soc = 100 * (remaining + cutoff) / capacity_uams
+        while stage + 1 < len(schedule) and \
+                (t_ms >= schedule[stage + 1][0] * 60000 or soc <= schedule[stage + 1][1]):
+            stage += 1
+        _, _, period_ms, pattern = schedule[stage]
+        on_ms, charge = pattern_charge(pattern)
+        remaining -= charge + period_ms * ACTIVE_HALT_UA
+        t_ms += period_ms
+        stats[stage][0] += period_ms
+        stats[stage][1] += on_ms
+    return stats
+
+
+def main():
+    capacity_mah = float(sys.argv[1]) if len(sys.argv) > 1 else 150
+    start_soc = float(sys.argv[2]) if len(sys.argv) > 2 else 100
+    print('Battery %.0f mAh, starting at %.0f%%, cutoff at %d mV (%.1f%%)' %
+          (capacity_mah, start_soc, UV_CUTOFF_MV, voltage_soc(UV_CUTOFF_MV)))
+
+    for name, schedule in SCHEDULES.items():
+        stats = simulate(schedule, capacity_mah, start_soc)
+        print('\nSchedule: %s' % name)
+        print('  stage  period[s]  pattern  avg[uA]  time[h]  audible[s]')
+        for i, (start, max_soc, period_ms, pattern) in enumerate(schedule):
+            on_ms, charge = pattern_charge(pattern)
+            avg_ua = ACTIVE_HALT_UA + charge / period_ms
+            print('  %5d  %9.0f  %7s  %7.0f  %7.2f  %10.0f' %
+                  (i, period_ms / 1000, pattern, avg_ua, stats[i][0] / 3600000, stats[i][1] / 1000))
+        total_h = sum(s[0] for s in stats) / 3600000
+        audible_s = sum(s[1] for s in stats) / 1000
+        print('  total: %.1f h, %.0f s audible' % (total_h, audible_s))
+
+
+if __name__ == '__main__':
+    main()